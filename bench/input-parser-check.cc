@@ -0,0 +1,218 @@
+#if 0  // Invoke with /bin/sh or simply add executable bit on this file on Unix.
+B=${0%%.cc}; [ "$B" -nt "$0" ] || c++ -std=c++17 -O2 -o"$B" "$0" && exec "$B" "$@";
+#endif
+// Copyright 2025 Henner Zeller <h.zeller@acm.org>
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Checks the parsers of the files run-clang-tidy-cached reads from other
+// tools against recorded samples:
+//  - <name>.yaml: fixes as written by clang-tidy --export-fixes.
+//  - <name>.json: compilation database, with @ROOT@ standing for the
+//    project root. It is loaded from two different temporary directories,
+//    which must result in the same fingerprints.
+// What is parsed is compared to the <name>.<ext>.expected next to it.
+//
+// Without arguments, all samples in bench/testdata/ are checked. With
+// --update, the expected files are written instead, to be reviewed with
+// git diff.
+//
+// Usage: bench/input-parser-check.cc [--update] [<sample>...]
+
+// Functions only used by main() are left unused.
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wunused-function"
+#define RUN_CLANG_TIDY_CACHED_NO_MAIN
+#include "../run-clang-tidy-cached.cc"
+#pragma GCC diagnostic pop
+
+namespace {
+// Text quoted C-style, so that whitespace and non-ASCII bytes are visible.
+std::string Quoted(std::string_view text) {
+  std::string result = "\"";
+  for (const char c : text) {
+    switch (c) {
+      case '"': result.append("\\\""); break;
+      case '\\': result.append("\\\\"); break;
+      case '\n': result.append("\\n"); break;
+      case '\t': result.append("\\t"); break;
+      default:
+        if (c >= ' ' && c < 0x7f) {
+          result.push_back(c);
+        } else {
+          char octal[8];
+          snprintf(octal, sizeof(octal), "\\%03o", (unsigned char)c);
+          result.append(octal);
+        }
+    }
+  }
+  return result.append("\"");
+}
+
+std::string DumpExportedFixes(const std::string &yaml) {
+  std::string result;
+  for (const Fix &fix : ParseExportedFixes(yaml)) {
+    result.append(fix.from_note ? "note-fix\n" : "fix\n");
+    for (const Replacement &r : fix.replacements) {
+      result.append("  ")
+          .append(r.file.string())
+          .append(" ")
+          .append(std::to_string(r.offset))
+          .append(" ")
+          .append(std::to_string(r.length))
+          .append(" ")
+          .append(Quoted(r.text))
+          .append("\n");
+    }
+  }
+  return result;
+}
+
+// Files of the compilation database relative to the project root, as
+// determined by the database itself.
+std::vector<std::string> DatabaseFiles(const std::string &json,
+                                       const fs::path &root) {
+  std::set<std::string> result;
+  JsonScanner scanner(json);
+  scanner.Consume('[');
+  while (scanner.ok() && scanner.Consume('{')) {
+    std::string directory;
+    std::string file;
+    while (scanner.ok() && !scanner.Consume('}')) {
+      const std::string key = scanner.String();
+      scanner.Consume(':');
+      if (key == "directory") {
+        directory = scanner.String();
+      } else if (key == "file") {
+        file = scanner.String();
+      } else {
+        scanner.SkipValue();
+      }
+      scanner.Consume(',');
+    }
+    scanner.Consume(',');
+    result.insert((fs::path(directory) / file)
+                      .lexically_normal()
+                      .lexically_relative(root)
+                      .string());
+  }
+  return {result.begin(), result.end()};
+}
+
+std::string Replaced(std::string in, std::string_view from,
+                     std::string_view to) {
+  for (size_t pos = 0; (pos = in.find(from, pos)) != std::string::npos;
+       pos += to.size()) {
+    in.replace(pos, from.size(), to);
+  }
+  return in;
+}
+
+// Load the compilation database in "root" and dump it. Fingerprints are
+// returned in "fingerprints".
+std::string LoadCompilationDatabase(const std::string &sample,
+                                    const fs::path &root,
+                                    std::vector<hash_t> *fingerprints) {
+  fs::create_directories(root);
+  const std::string json = Replaced(sample, "@ROOT@", root.string());
+  std::ofstream(root / "compile_commands.json") << json;
+  const fs::path cwd = fs::current_path();
+  fs::current_path(root);
+  CompilationDatabase db;
+  db.Load();
+  fs::current_path(cwd);
+
+  std::string result;
+  for (const std::string &file : DatabaseFiles(json, root)) {
+    fingerprints->push_back(db.FingerprintOf(file));
+    result.append(file).append("\n");
+    const CompilationDatabase::Command *command = db.CommandOf(file);
+    if (!command) {
+      result.append("  (compiled with multiple commands)\n");
+      continue;
+    }
+    result.append("  directory ")
+        .append(Quoted(Replaced(command->directory, root.string(), "@ROOT@")))
+        .append("\n");
+    for (const std::string &arg : command->args) {
+      result.append("  arg ")
+          .append(Quoted(Replaced(arg, root.string(), "@ROOT@")))
+          .append("\n");
+    }
+  }
+  return result;
+}
+
+std::string DumpCompilationDatabase(const fs::path &sample) {
+  const std::string json = GetContent(sample);
+  const fs::path tmp = fs::temp_directory_path() /
+                       ("input-parser-check." + std::to_string(getpid()));
+  std::vector<hash_t> fingerprints;
+  std::vector<hash_t> elsewhere_fingerprints;
+  std::string result =
+      LoadCompilationDatabase(json, tmp / "project", &fingerprints);
+  LoadCompilationDatabase(json, tmp / "elsewhere" / "checkout",
+                          &elsewhere_fingerprints);
+  std::error_code ec;
+  fs::remove_all(tmp, ec);
+  if (fingerprints != elsewhere_fingerprints) {
+    result.append("(fingerprints depend on the project location)\n");
+  }
+  return result;
+}
+}  // namespace
+
+int main(int argc, char *argv[]) {
+  bool update = false;
+  std::vector<fs::path> samples;
+  for (int i = 1; i < argc; ++i) {
+    if (std::string_view(argv[i]) == "--update") {
+      update = true;
+    } else {
+      samples.emplace_back(argv[i]);
+    }
+  }
+  if (samples.empty()) {
+    const fs::path testdata = fs::path(argv[0]).parent_path() / "testdata";
+    for (const auto &entry : fs::directory_iterator(testdata)) {
+      if (entry.path().extension() == ".yaml" ||
+          entry.path().extension() == ".json") {
+        samples.push_back(entry.path());
+      }
+    }
+    std::sort(samples.begin(), samples.end());
+  }
+
+  int mismatches = 0;
+  for (const fs::path &sample : samples) {
+    const std::string parsed = sample.extension() == ".json"
+                                   ? DumpCompilationDatabase(sample)
+                                   : DumpExportedFixes(GetContent(sample));
+    const fs::path expected_file = sample.string() + ".expected";
+    if (update) {
+      std::ofstream(expected_file) << parsed;
+      fprintf(stdout, "%s: updated\n", expected_file.c_str());
+      continue;
+    }
+    std::error_code ec;
+    if (!fs::exists(expected_file, ec) ||
+        GetContent(expected_file) != parsed) {
+      fprintf(stderr, "%s: differs from %s; parsed:\n%s", sample.c_str(),
+              expected_file.c_str(), parsed.c_str());
+      ++mismatches;
+      continue;
+    }
+    fprintf(stdout, "%s: ok\n", sample.c_str());
+  }
+  return mismatches == 0 ? 0 : 1;
+}
@@ -0,0 +1,288 @@
+#if 0  // Invoke with /bin/sh or simply add executable bit on this file on Unix.
+B=${0%%.cc}; [ "$B" -nt "$0" ] || c++ -std=c++17 -O2 -o"$B" "$0" && exec "$B" "$@";
+#endif
+// Copyright 2025 Henner Zeller <h.zeller@acm.org>
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Micro-benchmark of the clang-tidy output scanners in run-clang-tidy-cached
+// compared to the std::regex implementation they replaced. Verifies that
+// both produce identical results.
+//
+// Also verifies that the compression of the packed cache store round-trips
+// on the same outputs, all their lengths up to a few KiB, and inputs made to
+// hit the boundaries of the encoding: lengths around the 15 and 15 + 255
+// steps of the length extension, overlapping matches (runs) and offsets
+// at the maximum distance.
+//
+// Input are recorded clang-tidy outputs, e.g. created with
+//   clang-tidy some/file.cc > some-file.log
+// (or the files in the cache directory). Without input files, a synthetic
+// output resembling misc-include-cleaner on a large file is used.
+//
+// Usage: bench/output-scanner-bench.cc [<clang-tidy-output>...]
+
+// Functions only used by main() are left unused.
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wunused-function"
+#define RUN_CLANG_TIDY_CACHED_NO_MAIN
+#include "../run-clang-tidy-cached.cc"
+#pragma GCC diagnostic pop
+
+namespace {
+// -- The std::regex based implementation as reference.
+void RegexFilterCheckLines(std::string_view interesting_file,
+                           const std::string &in, std::ostream &out) {
+  static const std::regex file_with_tidy(
+      ".*(?:^|/)([^/]+):[0-9]+:[0-9]+:.*"
+      "\\[[a-zA-Z.]+-[a-zA-Z.-]+\\]$");
+  bool do_print_line = true;
+  std::istringstream line_reader(in);
+  std::string line;
+  std::smatch match;
+  while (std::getline(line_reader, line)) {
+    if (std::regex_match(line, match, file_with_tidy)) {
+      do_print_line = (match[1].str() == interesting_file);
+    }
+    if (do_print_line) {
+      out << line << "\n";
+    }
+  }
+}
+
+std::string RegexRemovePathPrefixes(const std::string &in,
+                                    const std::vector<std::string> &prefixes) {
+  std::string canonicalize_expr = "(^|\\n)(";
+  for (const std::string &prefix : prefixes) {
+    canonicalize_expr += prefix + "|";
+  }
+  canonicalize_expr.pop_back();
+  canonicalize_expr += ")?(\\./)?";
+  const std::regex fix_paths_re(canonicalize_expr);
+  return std::regex_replace(in, fix_paths_re, "$1");
+}
+
+std::map<std::string, int> RegexTally(const std::string &tidy) {
+  using ReIt = std::sregex_iterator;
+  const std::regex check_re("(?:^|\n).*(\\[[a-zA-Z.]+-[a-zA-Z.-]+\\])\n");
+  std::map<std::string, int> checks_seen;
+  std::unordered_set<std::string> line_already_seen;
+  for (ReIt it(tidy.begin(), tidy.end(), check_re); it != ReIt(); ++it) {
+    if (line_already_seen.insert((*it)[0]).second) {
+      checks_seen[(*it)[1].str()]++;
+    }
+  }
+  return checks_seen;
+}
+
+struct Result {
+  std::string canonical;
+  std::string filtered;
+  std::map<std::string, int> tally;
+
+  bool operator==(const Result &other) const {
+    return canonical == other.canonical && filtered == other.filtered &&
+           tally == other.tally;
+  }
+};
+
+Result RunRegex(const std::string &output, std::string_view file,
+                const std::vector<std::string> &prefixes) {
+  Result r;
+  r.canonical = RegexRemovePathPrefixes(output, prefixes);
+  std::ostringstream out;
+  RegexFilterCheckLines(file, r.canonical, out);
+  r.filtered = out.str();
+  r.tally = RegexTally(r.filtered);
+  return r;
+}
+
+// -- Same operations with the scanners.
+Result RunScanner(const std::string &output, std::string_view file,
+                  const std::vector<std::string> &prefixes) {
+  Result r;
+  r.canonical = RemovePathPrefixes(output, prefixes);
+  FilterCheckLines(file, r.canonical, &r.filtered);
+  r.tally = CountChecks(r.filtered);
+  return r;
+}
+
+// Seconds per call of fun, repeated for a minimum time.
+template <typename Fun>
+double TimeIt(Fun fun) {
+  using clock = std::chrono::steady_clock;
+  const auto start = clock::now();
+  int iterations = 0;
+  std::chrono::duration<double> elapsed;
+  do {
+    fun();
+    ++iterations;
+    elapsed = clock::now() - start;
+  } while (elapsed.count() < 0.5);
+  return elapsed.count() / iterations;
+}
+
+// Output resembling misc-include-cleaner and friends on a large file, with
+// some findings for included headers that are to be filtered out.
+std::string SyntheticOutput(const std::string &prefix) {
+  std::string result;
+  for (int i = 0; i < 20000; ++i) {
+    const bool in_header = (i % 7 == 0);
+    const std::string file = in_header ? "include/some/util.h"
+                                       : "src/large/file.cc";
+    result += prefix + file + ":" + std::to_string(i + 1) + ":" +
+              std::to_string(i % 80 + 1) +
+              ": warning: no header providing \"std::vector\" is directly"
+              " included [misc-include-cleaner]\n";
+    result += "   " + std::to_string(i + 1) +
+              " |   std::vector<int> values_" + std::to_string(i) + ";\n";
+    result += "     |   ^\n";
+    if (i % 13 == 0) {
+      result += prefix + file + ":" + std::to_string(i + 1) +
+                ":3: note: see https://example.com/a/b for details\n";
+    }
+  }
+  return result;
+}
+
+// Returns true if "in" survives compression and decompression. Also makes
+// sure truncated compressed data is rejected or at least decoded without
+// reading out of bounds (best observed with -fsanitize=address).
+bool RoundTrips(std::string_view in) {
+  const std::string compressed = lz::Compress(in);
+  const std::optional<std::string> out =
+      lz::Decompress(compressed, in.size());
+  if (!out || *out != in) {
+    return false;
+  }
+  for (size_t len = 0; len < compressed.size(); len += 1 + len / 4) {
+    const auto truncated =
+        lz::Decompress(std::string_view(compressed).substr(0, len), in.size());
+    if (truncated && *truncated != in) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Inputs at the boundaries of the compression format.
+std::vector<std::pair<std::string, std::string>> CompressionEdgeCases() {
+  std::vector<std::pair<std::string, std::string>> result;
+  std::string noise;  // No repeated 4-byte sequences: literals only.
+  for (uint32_t x = 1; noise.size() < 70000; x = x * 1103515245 + 12345) {
+    noise.push_back(static_cast<char>(x >> 16));
+  }
+  for (size_t len : {0, 1, 3, 4, 5, 14, 15, 16, 17, 18, 19, 20, 268, 269, 270,
+                     271, 273, 274, 275, 524, 525, 526, 1000}) {
+    const std::string name = std::to_string(len);
+    result.emplace_back("run of " + name, std::string(len, 'x'));
+    result.emplace_back("literals " + name, noise.substr(0, len));
+    // A match of the given length after literals of the given length.
+    const std::string literals = noise.substr(100, len);
+    const std::string match = noise.substr(1000, len + 4);
+    result.emplace_back("match " + name, match + literals + match);
+  }
+  // Matches overlapping the bytes they copy.
+  for (size_t period : {1, 2, 3, 4, 5, 7, 8, 16}) {
+    std::string periodic;
+    while (periodic.size() < 600) {
+      periodic.append(noise.substr(0, period));
+    }
+    result.emplace_back("period " + std::to_string(period), periodic);
+  }
+  for (size_t distance : {0xfffe, 0xffff, 0x10000, 0x10001}) {
+    const std::string repeated = noise.substr(0, 64);
+    result.emplace_back(
+        "distance " + std::to_string(distance),
+        repeated + noise.substr(64 + 4096, distance - 64) + repeated);
+  }
+  return result;
+}
+
+// The file clang-tidy was invoked on: basename of the first finding.
+std::string_view InterestingFile(std::string_view output) {
+  std::string_view result;
+  ForEachLine(output, [&](std::string_view line, bool) {
+    if (result.empty()) {
+      result = FindingFileBasename(line);
+    }
+  });
+  return result;
+}
+}  // namespace
+
+int main(int argc, char *argv[]) {
+  const std::vector<std::string> prefixes = {fs::current_path().string() +
+                                             "/"};
+  std::vector<std::pair<std::string, std::string>> inputs;
+  for (int i = 1; i < argc; ++i) {
+    inputs.emplace_back(argv[i], GetContent(fs::path(argv[i])));
+  }
+  if (inputs.empty()) {
+    inputs.emplace_back("<synthetic>", SyntheticOutput(prefixes[0]));
+  }
+
+  fprintf(stdout, "%10s %10s %10s %8s  %s\n", "bytes", "regex-ms",
+          "scanner-ms", "speedup", "input");
+  int mismatches = 0;
+  for (const auto &[name, output] : inputs) {
+    const std::string_view file = InterestingFile(output);
+    const Result expected = RunRegex(output, file, prefixes);
+    if (!(RunScanner(output, file, prefixes) == expected)) {
+      fprintf(stderr, "%s: scanner result differs from regex.\n",
+              name.c_str());
+      ++mismatches;
+      continue;
+    }
+    const double regex_time =
+        TimeIt([&]() { RunRegex(output, file, prefixes); });
+    const double scanner_time =
+        TimeIt([&]() { RunScanner(output, file, prefixes); });
+    fprintf(stdout, "%10zu %10.3f %10.3f %7.1fx  %s\n", output.size(),
+            regex_time * 1e3, scanner_time * 1e3, regex_time / scanner_time,
+            name.c_str());
+  }
+
+  // Compression round-trip on the outputs and the edge cases.
+  size_t checked = 0;
+  size_t original_bytes = 0;
+  size_t compressed_bytes = 0;
+  for (const auto &[name, output] : inputs) {
+    for (size_t len = 0; len <= std::min<size_t>(output.size(), 4096); ++len) {
+      if (!RoundTrips(std::string_view(output).substr(0, len))) {
+        fprintf(stderr, "%s: compression does not round-trip at %zu bytes.\n",
+                name.c_str(), len);
+        ++mismatches;
+        break;
+      }
+    }
+    if (!RoundTrips(output)) {
+      fprintf(stderr, "%s: compression does not round-trip.\n", name.c_str());
+      ++mismatches;
+    }
+    original_bytes += output.size();
+    compressed_bytes += lz::Compress(output).size();
+    ++checked;
+  }
+  for (const auto &[name, input] : CompressionEdgeCases()) {
+    if (!RoundTrips(input)) {
+      fprintf(stderr, "%s: compression does not round-trip.\n", name.c_str());
+      ++mismatches;
+    }
+    ++checked;
+  }
+  fprintf(stdout, "Compression round-trips on %zu inputs; outputs compressed "
+          "to %.1f%%.\n", checked,
+          100.0 * compressed_bytes / std::max<size_t>(original_bytes, 1));
+  return mismatches == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,452 @@
+#if 0  // Invoke with /bin/sh or simply add executable bit on this file on Unix.
+B=${0%%.cc}; [ "$B" -nt "$0" ] || c++ -std=c++17 -O2 -o"$B" "$0" && exec "$B" "$@";
+#endif
+// Copyright 2025 Henner Zeller <h.zeller@acm.org>
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Benchmark of the overhead of run-clang-tidy-cached itself on large
+// projects, without spending hours in clang-tidy.
+//
+// Generates a synthetic project with the given number of files, headers,
+// includes per file, header size and density of findings. The project is
+// then processed with this binary standing in as CLANG_TIDY: it emits
+// deterministic clang-tidy-like findings, the header trace the compiler
+// would print with -H, and takes the given time per file.
+//
+// Scenarios are a run with a cold cache, a warm run without changes and a
+// run after changing one header. For each, the phases as traced with
+// CLANG_TIDY_TRACE (e.g. gathering, hashing, scheduling, filtering the
+// output, report) and the metrics are printed as one line of JSON on stdout,
+// so that results can be compared e.g. before and after a change.
+//
+// Usage: bench/synthetic-project-bench.cc [<options>]
+//  --files=<n>          Translation units (default 2000).
+//  --headers=<n>        Headers in the project (default 200).
+//  --includes=<n>       Headers each translation unit includes (default 8).
+//  --header-lines=<n>   Lines of each header (default 100).
+//  --findings=<n>       Findings per 1000 lines (default 5).
+//  --file-ms=<n>        Time the stub clang-tidy takes per file (default 0).
+//  --startup-ms=<n>     Time per invocation of the stub (default 0).
+//  --jobs=<n>           CLANG_TIDY_JOBS (default: tool's choice).
+//  --dir=<dir>          Where to create project and cache
+//                       (default $TMPDIR/synthetic-project-bench).
+//  --tool=<binary>      Tool to benchmark (default: run-clang-tidy-cached.cc
+//                       in the current directory, invoked with /bin/sh).
+
+#include <fcntl.h>
+#include <spawn.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <map>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+namespace fs = std::filesystem;
+
+namespace {
+// If set, this binary acts as clang-tidy; contains the parameters.
+constexpr char kStubEnv[] = "SYNTHETIC_BENCH_CLANG_TIDY";
+
+struct Options {
+  int files = 2000;
+  int headers = 200;
+  int includes = 8;
+  int header_lines = 100;
+  int findings = 5;
+  int file_ms = 0;
+  int startup_ms = 0;
+  int jobs = 0;
+  fs::path dir;
+  std::string tool;
+};
+
+// Deterministic pseudo-random numbers, so that projects and outputs are
+// the same for the same parameters.
+uint64_t Mix(uint64_t x) {
+  x ^= x >> 33;
+  x *= 0xff51afd7ed558ccdULL;
+  x ^= x >> 33;
+  x *= 0xc4ceb93fe51a87d3ULL;
+  return x ^ (x >> 33);
+}
+
+std::string HeaderName(int i) { return "h" + std::to_string(i) + ".h"; }
+
+std::string GetContent(const fs::path &file) {
+  std::ifstream in(file, std::ios::binary);
+  std::stringstream content;
+  content << in.rdbuf();
+  return content.str();
+}
+
+void WriteFile(const fs::path &file, std::string_view content) {
+  fs::create_directories(file.parent_path());
+  FILE *out = fopen(file.c_str(), "wb");
+  if (!out) {
+    fprintf(stderr, "%s: can't write: %s\n", file.c_str(), strerror(errno));
+    exit(EXIT_FAILURE);
+  }
+  fwrite(content.data(), 1, content.size(), out);
+  fclose(out);
+}
+
+// Headers include their "parent" in a binary tree, so that some are used
+// (transitively) by many files, most by few. Translation units are spread
+// over directories of 100 files.
+void GenerateProject(const Options &options, const fs::path &project) {
+  const std::string body_line = "inline int Value(int x) { return x + 1; }\n";
+  for (int i = 0; i < options.headers; ++i) {
+    std::string content = "#pragma once\n";
+    if (i > 0) {
+      content += "#include \"" + HeaderName((i - 1) / 2) + "\"\n";
+    }
+    content += "namespace h" + std::to_string(i) + " {\n";
+    for (int line = 0; line < options.header_lines; ++line) {
+      content += body_line;
+    }
+    content += "}  // namespace\n";
+    WriteFile(project / "include" / HeaderName(i), content);
+  }
+  std::string compile_commands = "[\n";
+  for (int i = 0; i < options.files; ++i) {
+    const std::string file = "src/d" + std::to_string(i / 100) + "/f" +
+                             std::to_string(i) + ".cc";
+    std::string content;
+    for (int k = 0; k < options.includes && options.headers > 0; ++k) {
+      const uint64_t header = Mix(i * 1000 + k) % options.headers;
+      content += "#include \"" + HeaderName(header) + "\"\n";
+    }
+    content += "int Function" + std::to_string(i) + "() {\n";
+    for (int line = 0; line < 50; ++line) {
+      content += "  int v" + std::to_string(line) + " = 42;\n";
+    }
+    content += "  return 0;\n}\n";
+    WriteFile(project / file, content);
+    compile_commands += std::string(i > 0 ? ",\n" : "") + "{\"directory\":\"" +
+                        project.string() + "\",\"file\":\"" + file +
+                        "\",\"command\":\"c++ -Iinclude -c " + file + "\"}";
+  }
+  compile_commands += "\n]\n";
+  WriteFile(project / "compile_commands.json", compile_commands);
+  WriteFile(project / ".clang-tidy", "Checks: '-*,misc-*'\n");
+}
+
+// -- The stub clang-tidy.
+
+// Emit findings for "file" to stdout and the header trace to stderr
+// (recursing into includes), like clang-tidy with --extra-arg=-H does.
+void StubProcessFile(const fs::path &file, int findings, int depth,
+                     std::unordered_set<std::string> *seen) {
+  std::istringstream content(GetContent(file));
+  const fs::path include_dir = fs::current_path() / "include";
+  const uint64_t file_hash = std::hash<std::string>()(file.string());
+  int line_number = 0;
+  std::string line;
+  while (std::getline(content, line)) {
+    ++line_number;
+    if (line.rfind("#include \"", 0) == 0) {
+      const fs::path header = include_dir / line.substr(10, line.size() - 11);
+      fprintf(stderr, "%s %s\n", std::string(depth, '.').c_str(),
+              header.c_str());
+      if (seen->insert(header.string()).second) {
+        StubProcessFile(header, findings, depth + 1, seen);
+      }
+      continue;
+    }
+    const uint64_t r = Mix(file_hash + line_number);
+    if (int(r % 1000) < findings) {
+      fprintf(stdout,
+              "%s:%d:3: warning: synthetic finding number %d "
+              "[misc-synthetic-%d]\n"
+              "%5d | %s\n"
+              "      |   ^\n",
+              fs::absolute(file).c_str(), line_number, int(r % 97),
+              int(r % 5), line_number, line.c_str());
+    }
+  }
+}
+
+int StubMain(int argc, char *argv[]) {
+  int findings = 0;
+  int file_ms = 0;
+  int startup_ms = 0;
+  sscanf(getenv(kStubEnv), "%d,%d,%d", &findings, &file_ms, &startup_ms);
+  std::vector<fs::path> files;
+  std::string export_fixes;
+  for (int i = 1; i < argc; ++i) {
+    const std::string_view arg = argv[i];
+    if (arg == "--version") {
+      printf("LLVM (http://llvm.org/):\n  LLVM version 18.1.8-synthetic\n");
+      return EXIT_SUCCESS;
+    }
+    if (arg == "--list-checks") {
+      printf("Enabled checks:\n");
+      for (int c = 0; c < 5; ++c) {
+        printf("    misc-synthetic-%d\n", c);
+      }
+      printf("\n");
+      return EXIT_SUCCESS;
+    }
+    if (arg == "--dump-config") {
+      printf("---\nChecks: '-*,misc-*'\nHeaderFilterRegex: ''\n...\n");
+      return EXIT_SUCCESS;
+    }
+    if (arg.substr(0, 15) == "--export-fixes=") {
+      export_fixes = arg.substr(15);
+    } else if (arg.substr(0, 1) != "-") {
+      files.emplace_back(arg);
+    }
+  }
+  std::this_thread::sleep_for(std::chrono::milliseconds(startup_ms));
+  for (const fs::path &file : files) {
+    std::unordered_set<std::string> seen;
+    StubProcessFile(file, findings, 1, &seen);
+    std::this_thread::sleep_for(std::chrono::milliseconds(file_ms));
+  }
+  if (!export_fixes.empty()) {
+    WriteFile(export_fixes, "---\nDiagnostics: []\n...\n");
+  }
+  return EXIT_SUCCESS;
+}
+
+// -- The benchmark.
+
+struct Measurement {
+  double wall_seconds = 0;
+  std::map<std::string, double> phase_seconds;
+  std::map<std::string, std::string> metrics;
+};
+
+// Sum up durations of the spans in the trace per phase; spans of clang-tidy
+// output processing are summed as "filter output".
+void ReadTrace(const fs::path &trace_file, Measurement *measurement) {
+  std::istringstream trace(GetContent(trace_file));
+  auto value_of = [](std::string_view json, std::string_view key) {
+    const std::string needle = "\"" + std::string(key) + "\":";
+    const size_t pos = json.find(needle);
+    if (pos == std::string_view::npos) {
+      return std::string_view();
+    }
+    std::string_view value = json.substr(pos + needle.size());
+    if (!value.empty() && value.front() == '"') {
+      value.remove_prefix(1);
+      return value.substr(0, value.find('"'));
+    }
+    return value.substr(0, value.find_first_of(",}"));
+  };
+  std::string trace_line;
+  while (std::getline(trace, trace_line)) {
+    std::string_view line = trace_line;
+    if (line.substr(0, 9) == "{\"name\":\"") {
+      const std::string_view category = value_of(line, "cat");
+      const double seconds =
+          strtod(std::string(value_of(line, "dur")).c_str(), nullptr) / 1e6;
+      if (category == "phase") {
+        measurement->phase_seconds[std::string(value_of(line, "name"))] +=
+            seconds;
+      } else if (category == "output") {
+        measurement->phase_seconds["filter output"] += seconds;
+      }
+    } else if (line.substr(0, 13) == "\"otherData\":{") {
+      line.remove_prefix(13);
+      while (line.find("\":") != std::string_view::npos) {
+        const size_t key_end = line.find("\":");
+        const std::string key(line.substr(1, key_end - 1));
+        line.remove_prefix(key_end + 2);
+        const size_t value_end = line.find_first_of(",}");
+        measurement->metrics[key] = std::string(line.substr(0, value_end));
+        line.remove_prefix(std::min(value_end + 1, line.size()));
+      }
+    }
+  }
+}
+
+// Run "command" with stdout discarded and stderr written to "err_file".
+// Returns the wait status or -1 if it could not be started.
+int RunProcess(const std::vector<std::string> &command,
+               const fs::path &err_file) {
+  std::vector<char *> argv;
+  for (const std::string &arg : command) {
+    argv.push_back(const_cast<char *>(arg.c_str()));
+  }
+  argv.push_back(nullptr);
+  posix_spawn_file_actions_t actions;
+  posix_spawn_file_actions_init(&actions);
+  posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO, "/dev/null",
+                                   O_WRONLY, 0);
+  posix_spawn_file_actions_addopen(&actions, STDERR_FILENO, err_file.c_str(),
+                                   O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  pid_t pid;
+  const int spawn_error = posix_spawnp(&pid, argv[0], &actions, nullptr,
+                                       argv.data(), environ);
+  posix_spawn_file_actions_destroy(&actions);
+  int status;
+  if (spawn_error != 0 || waitpid(pid, &status, 0) < 0) {
+    return -1;
+  }
+  return status;
+}
+
+Measurement RunTool(const Options &options, const fs::path &project,
+                    const std::string &scenario) {
+  const fs::path trace_file = options.dir / ("trace-" + scenario + ".json");
+  setenv("CLANG_TIDY_TRACE", trace_file.c_str(), 1);
+  std::vector<std::string> command = {options.tool};
+  if (options.tool.size() > 3 &&
+      options.tool.substr(options.tool.size() - 3) == ".cc") {
+    command.insert(command.begin(), "/bin/sh");
+  }
+  const fs::path previous_dir = fs::current_path();
+  fs::current_path(project);
+  const fs::path err_file = options.dir / ("stderr-" + scenario + ".log");
+  const auto start = std::chrono::steady_clock::now();
+  const int status = RunProcess(command, err_file);
+  Measurement result;
+  result.wall_seconds = std::chrono::duration<double>(
+                            std::chrono::steady_clock::now() - start)
+                            .count();
+  fs::current_path(previous_dir);
+  if (status < 0 || !WIFEXITED(status) || WEXITSTATUS(status) > 1) {
+    fprintf(stderr, "%s failed in scenario %s:\n%s\n", options.tool.c_str(),
+            scenario.c_str(), GetContent(err_file).c_str());
+    exit(EXIT_FAILURE);
+  }
+  ReadTrace(trace_file, &result);
+  return result;
+}
+
+void PrintJson(const Options &options, const std::string &scenario,
+               const Measurement &m) {
+  printf("{\"scenario\":\"%s\",\"files\":%d,\"headers\":%d,\"includes\":%d,"
+         "\"header_lines\":%d,\"findings\":%d,\"file_ms\":%d,"
+         "\"startup_ms\":%d,\"wall_seconds\":%.3f,\"phase_seconds\":{",
+         scenario.c_str(), options.files, options.headers, options.includes,
+         options.header_lines, options.findings, options.file_ms,
+         options.startup_ms, m.wall_seconds);
+  const char *separator = "";
+  for (const auto &[phase, seconds] : m.phase_seconds) {
+    printf("%s\"%s\":%.4f", separator, phase.c_str(), seconds);
+    separator = ",";
+  }
+  printf("},\"metrics\":{");
+  separator = "";
+  for (const auto &[name, value] : m.metrics) {
+    printf("%s\"%s\":%s", separator, name.c_str(), value.c_str());
+    separator = ",";
+  }
+  printf("}}\n");
+  fflush(stdout);
+}
+
+void PrintSummary(const std::string &scenario, const Measurement &m) {
+  fprintf(stderr, "%-16s %8.3fs wall", scenario.c_str(), m.wall_seconds);
+  for (const char *phase : {"find files", "build work list", "schedule",
+                            "filter output", "report"}) {
+    const auto found = m.phase_seconds.find(phase);
+    fprintf(stderr, "  %s %.3fs", phase,
+            found == m.phase_seconds.end() ? 0.0 : found->second);
+  }
+  fprintf(stderr, "\n");
+}
+
+bool ParseFlag(std::string_view arg, std::string_view name, int *value) {
+  if (arg.substr(0, name.size()) != name) {
+    return false;
+  }
+  *value = atoi(std::string(arg.substr(name.size())).c_str());
+  return true;
+}
+}  // namespace
+
+int main(int argc, char *argv[]) {
+  if (getenv(kStubEnv)) {
+    return StubMain(argc, argv);
+  }
+  Options options;
+  const char *tmpdir = getenv("TMPDIR");
+  options.dir = fs::path(tmpdir ? tmpdir : "/tmp") / "synthetic-project-bench";
+  options.tool = fs::absolute("run-clang-tidy-cached.cc").string();
+  for (int i = 1; i < argc; ++i) {
+    const std::string_view arg = argv[i];
+    if (ParseFlag(arg, "--files=", &options.files) ||
+        ParseFlag(arg, "--headers=", &options.headers) ||
+        ParseFlag(arg, "--includes=", &options.includes) ||
+        ParseFlag(arg, "--header-lines=", &options.header_lines) ||
+        ParseFlag(arg, "--findings=", &options.findings) ||
+        ParseFlag(arg, "--file-ms=", &options.file_ms) ||
+        ParseFlag(arg, "--startup-ms=", &options.startup_ms) ||
+        ParseFlag(arg, "--jobs=", &options.jobs)) {
+      continue;
+    }
+    if (arg.substr(0, 6) == "--dir=") {
+      options.dir = fs::absolute(arg.substr(6));
+    } else if (arg.substr(0, 7) == "--tool=") {
+      options.tool = fs::absolute(arg.substr(7)).string();
+    } else {
+      fprintf(stderr, "Unknown option %s; see usage in %s.cc\n", argv[i],
+              argv[0]);
+      return EXIT_FAILURE;
+    }
+  }
+
+  // Start from scratch to have a well-defined cold run.
+  const fs::path project = options.dir / "project";
+  fs::remove_all(options.dir);
+  GenerateProject(options, project);
+
+  const std::string stub_config = std::to_string(options.findings) + "," +
+                                  std::to_string(options.file_ms) + "," +
+                                  std::to_string(options.startup_ms);
+  setenv(kStubEnv, stub_config.c_str(), 1);
+  setenv("CLANG_TIDY", fs::absolute(argv[0]).c_str(), 1);
+  setenv("CACHE_DIR", (options.dir / "cache").c_str(), 1);
+  unsetenv("CLANG_TIDY_CONFIG");
+  if (options.jobs > 0) {
+    setenv("CLANG_TIDY_JOBS", std::to_string(options.jobs).c_str(), 1);
+  }
+
+  const std::pair<std::string, std::function<void()>> scenarios[] = {
+      {"cold", [] {}},
+      {"warm", [] {}},
+      {"header-changed",
+       [&] {
+         // A header in the middle of the include tree.
+         const fs::path header =
+             project / "include" / HeaderName(options.headers / 4);
+         WriteFile(header, GetContent(header) + "// changed\n");
+       }},
+  };
+  for (const auto &[scenario, prepare] : scenarios) {
+    prepare();
+    const Measurement measurement = RunTool(options, project, scenario);
+    PrintJson(options, scenario, measurement);
+    PrintSummary(scenario, measurement);
+  }
+  return EXIT_SUCCESS;
+}
@@ -20,25 +20,95 @@ B=${0%%.cc}; [ "$B" -nt "$0" ] || c++ -std=c++17 -o"$B" "$0" && exec "$B" "$@";
 // Script to run clang-tidy on files in a bazel project while caching the
 // results as clang-tidy can be pretty slow. The clang-tidy output messages
 // are content-addressed in a hash(cc-file-content) cache file.
-// Should run on any system with a shell that provides 2>/dev/null redirect.
+// Should run on any POSIX system.
 //
 // Invocation without parameters simply uses the .clang-tidy config to run on
 // all *.{cc,h} files. Additional parameters passed to this script are passed
 // to clang-tidy as-is. Typical use could be for instance
 //   run-clang-tidy-cached.cc --checks="-*,modernize-use-override" --fix
+// If --checks=<globs> is the only parameter and only narrows down the checks
+// of the configuration, results are derived from the cache of runs without
+// it; clang-tidy is only invoked for files not in there.
 //
 // Note: useful environment variables to configure are
 //  CLANG_TIDY         = binary to run; default would just be clang-tidy.
+//  CLANG_FORMAT       = clang-format binary to format fixes with (see --fix)
 //  CLANG_TIDY_CONFIG  = override configuration file in kConfig.clang_tidy_file
+//  CLANG_TIDY_FILE_LIST = "walk" or "git"; see kConfig.file_list
 //  CACHE_DIR          = where to put the cached content; default ~/.cache
+//  CACHE_STORE        = "files" or "packed"; see kConfig.cache_store
+//  CACHE_COMPRESS     = 1 or 0: compress packed store; see compress_cache
 //  CLANG_TIDY_JOBS    = Number of tasks to run in parallel.
+//  CLANG_TIDY_BATCH_SIZE = Max files per clang-tidy call. See max_batch_size
+//  CACHE_MAX_SIZE     = Keep cache within this size, e.g. 2G (see --gc below)
+//  CACHE_MAX_AGE_DAYS = Remove cache entries not used within that many days.
+//  CLANG_TIDY_MEM_BUDGET = Max memory used by all clang-tidy jobs, e.g. 64G.
+//  CLANG_TIDY_NICE    = Run clang-tidy with lower CPU and I/O priority.
+//  CLANG_TIDY_PCH     = Compiler to build precompiled headers with; see
+//                       precompiled_header_compiler.
+//  CLANG_TIDY_TRACE   = Write a Chrome trace of phases and clang-tidy
+//                       invocations to this file and print metrics. With
+//                       --watch, each round replaces the previous trace.
+//
+// Flags handled by this script and not passed to clang-tidy:
+//  --gc               = Only collect garbage in the cache to keep it within
+//                       CACHE_MAX_SIZE and CACHE_MAX_AGE_DAYS. This is also
+//                       done automatically once a day if these are set.
+//  --since=<rev>      = Only look at files changed since the merge base with
+//                       git revision <rev> (e.g. origin/main), including
+//                       uncommitted changes. The report only contains these.
+//  --include-dependents = With --since: also look at files that included any
+//                       of the changed files in their last run.
+//  --watch            = After the run, keep watching for files being saved
+//                       and re-tidy them and the files depending on them.
+//                       The report is updated after each round (Linux only).
+//  --shard=<i>/<N>    = Only look at the i-th (1-based) of N about equally
+//                       long running partitions of the files, e.g. to
+//                       distribute a run on N machines. Writes a report for
+//                       the shard and a <shard>_clang-tidy.export file.
+//                       Balancing is by file size unless --shard-weights
+//                       is given, so that all nodes get the same partition.
+//  --shard-weights=<file> = With --shard: balance by the time each file
+//                       took, as written by the --merge step of a previous
+//                       distributed run. All nodes need to use the same file.
+//  --merge=<file>     = Merge exported results of a shard into the cache
+//                       before running. With all shards merged, this creates
+//                       the report of a full run without invoking clang-tidy.
+//                       Files no export had a result for are listed. Also
+//                       writes <prefix>clang-tidy.shard-weights for the next
+//                       distributed run. Can be given multiple times.
+//  --fix, --fix-errors, --fix-notes = As with clang-tidy, but the parallel
+//                       jobs only export their fixes, which are cached. Once
+//                       all are done, the fixes are de-duplicated and applied
+//                       in one pass per file, so that concurrent jobs don't
+//                       edit the same headers. Fixes conflicting with others
+//                       are left for the next run. With a format style
+//                       (--format-style or FormatStyle in the config), the
+//                       replaced lines are then formatted with clang-format.
 
 // This file shall be c++17 self-contained; not using any re2 or absl niceties.
+#include <fcntl.h>
+#include <poll.h>
+#include <spawn.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
 #include <unistd.h>
 
+#ifdef __linux__
+#include <sys/inotify.h>
+#include <sys/syscall.h>
+#endif
+
 #include <algorithm>
+#include <atomic>
+#include <cctype>
 #include <cerrno>
+#include <chrono>
 #include <cinttypes>
+#include <condition_variable>
 #include <csignal>
 #include <cstdint>
 #include <cstdio>
@@ -51,13 +121,20 @@ B=${0%%.cc}; [ "$B" -nt "$0" ] || c++ -std=c++17 -o"$B" "$0" && exec "$B" "$@";
 #include <iostream>
 #include <list>
 #include <map>
+#include <memory>
 #include <mutex>
+#include <numeric>
+#include <optional>
+#include <queue>
 #include <regex>
+#include <set>
+#include <shared_mutex>
 #include <sstream>
 #include <string>
 #include <string_view>
 #include <system_error>
 #include <thread>
+#include <unordered_map>
 #include <unordered_set>
 #include <utility>
 #include <vector>
@@ -78,8 +155,29 @@ struct ConfigValues {
 
   // Regular expxression matching files that should be excluded from file list.
   // If searching from toplevel, make sure to include at least ".git/".
+  // Directories it matches with a trailing slash (e.g. "build/") are not
+  // descended into.
   std::string_view file_exclude_re = "^(\\.git|\\.github|build)/";
 
+  // How to find the files below start_dir. Can be overridden with
+  // CLANG_TIDY_FILE_LIST.
+  //   "walk" : all files in the directory tree.
+  //   "git"  : the files git knows about: tracked files and untracked ones
+  //            that are not ignored. Faster on large trees as it does not
+  //            need to walk the file system. Falls back to "walk" if git
+  //            can't list the files.
+  std::string_view file_list = "walk";
+
+  // Take the translation units from compile_commands.json, so that each is
+  // processed with its exact compile command; other source files are not
+  // processed with guessed flags. Headers are not processed on their own
+  // either: their findings are taken from the run of a translation unit
+  // including them. (This needs revisit_if_any_include_changes to know which
+  // headers a translation unit includes). Headers not included by any of
+  // the translation units looked at are not checked. Each clang-tidy call
+  // gets a single translation unit, regardless of CLANG_TIDY_BATCH_SIZE.
+  bool files_from_compilation_db = false;
+
   // A file in the toplevel of the project that should exist, typically
   // something used to set up the build environment, such as MODULE.bazel,
   // CMakeLists.txt or similar.
@@ -88,6 +186,8 @@ struct ConfigValues {
   //   - To take changes there into account as that build file might provide
   //     additional dependencies which might change clang-tidy outcome.
   //     (if revisit_brokenfiles_if_build_config_newer is on).
+  // (Changes in the compilation DB are tracked per file: only files whose
+  // compile command changed are revisited).
   // (Default configuration: just .clang-tidy as this should always be there)
   std::string_view toplevel_build_file = ".clang-tidy";
 
@@ -96,19 +196,21 @@ struct ConfigValues {
   // these in the output. Set to true if this is a bazel project.
   bool is_bazel_project = false;
 
-  // If the compilation DB or toplevel_build_file changed in timestamp, it
-  // might be worthwhile revisiting sources that previously had issues.
+  // If the toplevel_build_file changed in timestamp, it might be worthwhile
+  // revisiting sources that previously had issues.
   // This flag enables that.
   //
   // It is good to set once the project is 'clean' and there are only a
   // few problematic sources to begin with, otherwise every update of the
-  // compilation DB will re-trigger revisiting all of them.
+  // build file will re-trigger revisiting all of them.
   bool revisit_brokenfiles_if_build_config_newer = true;
 
   // Revisit a source file if any of its include files changed content. Say
   // foo.cc includes bar.h. Reprocess foo.cc with clang-tidy when bar.h changed,
   // even if foo.cc is unchanged. This will find issues in which foo.cc relies
   // on something bar.h provides.
+  // The headers considered are exactly the project headers the compiler
+  // included (also transitively) in the last clang-tidy run of that file.
   // Usually good to keep on, but it can result in situations in which a header
   // that is included by a lot of other files results in lots of reprocessing.
   bool revisit_if_any_include_changes = true;
@@ -116,6 +218,48 @@ struct ConfigValues {
   // Clang tidy configuration: clang tidy files with checks. This can be
   // overriden with environment variable CLANG_TIDY_CONFIG
   std::string_view clang_tidy_file = ".clang-tidy";
+
+  // Let clang-tidy use the .clang-tidy file closest to each file, as it does
+  // by default, instead of only the toplevel clang_tidy_file. The results
+  // of a file then depend on the configuration in its directory and the
+  // ones it inherits from (InheritParentConfig), so editing one only
+  // revisits the files using it. Not used if CLANG_TIDY_CONFIG is set.
+  bool hierarchical_clang_tidy_configs = false;
+
+  // How to store cached results. Can be overridden with CACHE_STORE.
+  //   "files"  : one file per result. Simple to inspect.
+  //   "packed" : all results in a single append-only pack file with an
+  //              index. Better for large projects as it does not need an
+  //              inode per entry.
+  std::string_view cache_store = "files";
+
+  // With the "packed" cache_store, compress larger results if that saves
+  // space. Can be overridden with CACHE_COMPRESS=1 (or 0).
+  bool compress_cache = false;
+
+  // Maximum number of files to pass to a single clang-tidy invocation.
+  // Batching saves the start-up cost of clang-tidy per file (such as reading
+  // a large compile_commands.json), the combined output is split per file.
+  // Towards the end of the work queue, batches get smaller to keep all jobs
+  // busy. Can be overridden with CLANG_TIDY_BATCH_SIZE.
+  // Note: with revisit_if_any_include_changes, headers included by any file
+  // in a batch are attributed to all of them.
+  int max_batch_size = 1;
+
+  // Fraction of the available memory all parallel clang-tidy processes
+  // together should stay within, e.g. 0.8; 0 for no limit. The memory a
+  // file needs is predicted from its last run, the next job is only started
+  // once the predicted total stays within budget. Can be overridden with an
+  // absolute CLANG_TIDY_MEM_BUDGET.
+  double memory_budget_fraction = 0;
+
+  // Compiler to build precompiled headers with, e.g. "clang++-19". It needs
+  // to be the same version clang-tidy is built from. If set, files with
+  // identical compile commands that start with the same #includes share a
+  // precompiled header of these, so that they are only parsed once.
+  // Files clang-tidy fails on with the precompiled header are processed
+  // again without. Can be overridden with CLANG_TIDY_PCH.
+  std::string_view precompiled_header_compiler;
 };
 
 // --------------[ Project-specific configuration ]--------------
@@ -155,11 +299,24 @@ namespace {
 
 namespace fs = std::filesystem;
 using file_time = std::filesystem::file_time_type;
-using ReIt = std::sregex_iterator;
 using hash_t = uint64_t;
 using filepath_contenthash_t = std::pair<fs::path, hash_t>;
 
 // Some helpers
+// Call "fun" for each line in content; the last line might not be
+// terminated by a newline.
+template <typename Fun>
+void ForEachLine(std::string_view content, Fun fun) {
+  while (!content.empty()) {
+    const size_t eol = content.find('\n');
+    fun(content.substr(0, eol), eol != std::string_view::npos);
+    if (eol == std::string_view::npos) {
+      break;
+    }
+    content.remove_prefix(eol + 1);
+  }
+}
+
 std::string GetContent(FILE *f) {
   std::string result;
   if (!f) {
@@ -188,440 +345,6125 @@ std::string_view EnvWithFallback(const char *var, std::string_view fallback) {
   return value ? value : fallback;
 }
 
-std::string_view GetClangTidyConfig() {
-  return EnvWithFallback("CLANG_TIDY_CONFIG", kConfig.clang_tidy_file);
+// Parse sizes such as 500M or 2G; 0 if not set.
+uint64_t ParseSize(const char *value) {
+  if (!value) {
+    return 0;
+  }
+  char *suffix = nullptr;
+  const double number = strtod(value, &suffix);
+  double multiplier = 1;
+  switch (toupper(*suffix)) {
+    case 'T': multiplier *= 1024; [[fallthrough]];
+    case 'G': multiplier *= 1024; [[fallthrough]];
+    case 'M': multiplier *= 1024; [[fallthrough]];
+    case 'K': multiplier *= 1024; break;
+    default: break;
+  }
+  return number > 0 ? static_cast<uint64_t>(number * multiplier) : 0;
 }
 
-std::string GetCommandOutput(const std::string &prog) {
-  return GetContent(popen(prog.c_str(), "r"));  // NOLINT
+// Memory available for new processes without swapping.
+uint64_t AvailableMemory() {
+#ifdef __linux__
+  FILE *meminfo = fopen("/proc/meminfo", "r");
+  if (meminfo) {
+    char line[256];
+    uint64_t available_kb = 0;
+    while (fgets(line, sizeof(line), meminfo)) {
+      if (sscanf(line, "MemAvailable: %" SCNu64 " kB", &available_kb) == 1) {
+        break;
+      }
+    }
+    fclose(meminfo);
+    if (available_kb > 0) {
+      return available_kb * 1024;
+    }
+  }
+#endif
+#ifdef _SC_AVPHYS_PAGES
+  const long pages = sysconf(_SC_AVPHYS_PAGES);
+  const long page_size = sysconf(_SC_PAGESIZE);
+  if (pages > 0 && page_size > 0) {
+    return static_cast<uint64_t>(pages) * page_size;
+  }
+#endif
+  return 0;  // Unknown.
 }
 
-hash_t hashContent(const std::string &s) { return std::hash<std::string>()(s); }
-std::string ToHex(uint64_t value, int show_lower_nibbles = 16) {
-  char out[16 + 1];
-  snprintf(out, sizeof(out), "%016" PRIx64, value);
-  return out + (16 - show_lower_nibbles);
+// Memory the clang-tidy processes together may use, in KiB; 0 if unlimited.
+uint64_t GetMemoryBudgetKb() {
+  if (const uint64_t budget = ParseSize(getenv("CLANG_TIDY_MEM_BUDGET"))) {
+    return budget / 1024;
+  }
+  if (kConfig.memory_budget_fraction <= 0) {
+    return 0;
+  }
+  return AvailableMemory() * kConfig.memory_budget_fraction / 1024;
 }
 
-// Mapping filepath_contenthash_t to an actual location in the file system.
-class ContentAddressedStore {
- public:
-  explicit ContentAddressedStore(const fs::path &project_base_dir)
-      : content_dir(project_base_dir / "contents") {
-    fs::create_directories(content_dir);
+// If requested, lower CPU and I/O priority of this process and with that of
+// all the threads and child processes started afterwards, so that
+// interactive work is not starved.
+void MaybeLowerPriority() {
+  const int nice_increment =
+      atoi(EnvWithFallback("CLANG_TIDY_NICE", "0").data());
+  if (nice_increment <= 0) {
+    return;
   }
+  setpriority(PRIO_PROCESS, 0, nice_increment);
+#if defined(__linux__) && defined(SYS_ioprio_set)
+  // Best effort I/O class (2), lowest priority (7).
+  constexpr int kIoprioWhoProcess = 1;
+  constexpr int kIoprioClassShift = 13;
+  syscall(SYS_ioprio_set, kIoprioWhoProcess, 0, (2 << kIoprioClassShift) | 7);
+#endif
+}
 
-  // Given filepath contenthash, return the path to read/write from.
-  fs::path PathFor(const filepath_contenthash_t &c) const {
-    // Name is human readable, the content hash makes it unique.
-    std::string name_with_contenthash = c.first.filename().string();
-    name_with_contenthash.append("-").append(ToHex(c.second));
-    return content_dir / name_with_contenthash;
-  }
+// Files per clang-tidy invocation; configured with CLANG_TIDY_BATCH_SIZE.
+int GetBatchSize() {
+  const char *batch_env_str = getenv("CLANG_TIDY_BATCH_SIZE");
+  const int batch_env_num = batch_env_str ? atoi(batch_env_str) : -1;
+  return std::max(1, batch_env_num > 0 ? batch_env_num
+                                       : kConfig.max_batch_size);
+}
 
-  std::string GetContentFor(const filepath_contenthash_t &c) const {
-    return GetContent(PathFor(c));
-  }
+// Number of parallel jobs; configured with CLANG_TIDY_JOBS.
+int GetJobCount() {
+  const char *jobs_env_str = getenv("CLANG_TIDY_JOBS");
+  const int jobs_env_num = jobs_env_str ? atoi(jobs_env_str) : -1;
+  return jobs_env_num > 0 ? jobs_env_num
+                          : std::max(1U, std::thread::hardware_concurrency());
+}
 
-  // Check if this needs to be recreated, either because it is not there,
-  // or is not empty and does not fit freshness requirements.
-  bool NeedsRefresh(const filepath_contenthash_t &c,
-                    file_time min_freshness) const {
-    const fs::path content_hash_file = PathFor(c);
-    if (!fs::exists(content_hash_file)) {
-      return true;
+// Call "fun" for every index in [0..count) using "jobs" threads.
+void ParallelFor(size_t count, int jobs,
+                 const std::function<void(size_t)> &fun) {
+  std::atomic<size_t> next{0};
+  auto worker = [&]() {
+    for (size_t i; (i = next.fetch_add(1)) < count;) {
+      fun(i);
     }
-
-    // If file exists but is broken (i.e. has a non-zero size with messages),
-    // consider recreating if if older than compilation db.
-    const bool timestamp_trigger =
-        kConfig.revisit_brokenfiles_if_build_config_newer &&
-        (fs::file_size(content_hash_file) > 0 &&
-         fs::last_write_time(content_hash_file) < min_freshness);
-    return timestamp_trigger;
+  };
+  std::vector<std::thread> workers;
+  for (int i = 1; i < jobs; ++i) {
+    workers.emplace_back(worker);
+  }
+  worker();  // Current thread participates.
+  for (auto &t : workers) {
+    t.join();
   }
+}
 
- private:
-  const fs::path content_dir;
-};
+std::string_view GetClangTidyConfig() {
+  return EnvWithFallback("CLANG_TIDY_CONFIG", kConfig.clang_tidy_file);
+}
 
-class ClangTidyRunner {
- public:
-  ClangTidyRunner(const std::string &cache_prefix, int argc, char **argv)
-      : clang_tidy_(EnvWithFallback("CLANG_TIDY", "clang-tidy")),
-        clang_tidy_args_(AssembleArgs(argc, argv)) {
-    project_cache_dir_ = AssembleProjectCacheDir(cache_prefix);
+bool UseHierarchicalConfigs() {
+  return kConfig.hierarchical_clang_tidy_configs &&
+         !getenv("CLANG_TIDY_CONFIG");
+}
+
+std::string GetCommandOutput(const std::string &prog) {
+  return GetContent(popen(prog.c_str(), "r"));  // NOLINT
+}
+
+// Run program with arguments directly (no shell involved) and collect its
+// stdout in "out" and, if non-null, stderr in "err"; otherwise stderr is
+// discarded. SIGINT and SIGQUIT are reset to default in the child, so it can
+// be interrupted even if we ignore them.
+// Returns the wait status as provided by waitpid() or -1 if the process
+// could not be started. If "max_rss_kb" is given, it receives the peak
+// resident memory of the process.
+int RunProcess(const std::vector<std::string> &args, std::string *out,
+               std::string *err = nullptr, uint64_t *max_rss_kb = nullptr) {
+  std::vector<char *> argv;
+  for (const std::string &arg : args) {
+    argv.push_back(const_cast<char *>(arg.c_str()));  // NOLINT
   }
+  argv.push_back(nullptr);
 
-  const fs::path &project_cache_dir() const { return project_cache_dir_; }
+  posix_spawnattr_t attr;
+  posix_spawnattr_init(&attr);
+  sigset_t default_signals;
+  sigemptyset(&default_signals);
+  sigaddset(&default_signals, SIGINT);
+  sigaddset(&default_signals, SIGQUIT);
+  posix_spawnattr_setsigdefault(&attr, &default_signals);
+  posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGDEF);
 
-  // Given a work-queue in/out-file, process it. Using system() for portability.
-  // Empties work_queue.
-  void RunClangTidyOn(ContentAddressedStore &output_store,
-                      std::list<filepath_contenthash_t> *work_queue) {
-    if (work_queue->empty()) {
-      return;
+  // Pipe creation and spawn are serialized, as we can't portably create pipes
+  // with O_CLOEXEC atomically; otherwise, another thread might leak our
+  // write-end into its child and we'd never see EOF.
+  static std::mutex spawn_lock;
+  int out_fds[2];
+  int err_fds[2] = {-1, -1};
+  pid_t pid = -1;
+  int spawn_error = 0;
+  {
+    const std::lock_guard<std::mutex> lock(spawn_lock);
+    if (pipe(out_fds) != 0) {
+      posix_spawnattr_destroy(&attr);
+      return -1;
     }
-    const char *jobs_env_str = getenv("CLANG_TIDY_JOBS");
-    const int jobs_env_num = jobs_env_str ? atoi(jobs_env_str) : -1;
-    const int kJobs =
-        (jobs_env_num > 0 ? jobs_env_num : std::thread::hardware_concurrency());
-    std::cerr << work_queue->size() << " files to process (w/ " << kJobs
-              << " jobs)...";
-
-    const bool print_progress = isatty(STDERR_FILENO);
-    if (!print_progress) {
-      std::cerr << "\n";
+    if (err && pipe(err_fds) != 0) {
+      close(out_fds[0]);
+      close(out_fds[1]);
+      posix_spawnattr_destroy(&attr);
+      return -1;
     }
-
-    const std::string uniquifier = "." + std::to_string(getpid());
-    std::mutex queue_access_lock;
-    auto clang_tidy_runner = [&]() {
-      for (;;) {
-        filepath_contenthash_t work;
-        {
-          const std::lock_guard<std::mutex> lock(queue_access_lock);
-          if (work_queue->empty()) {
-            return;
-          }
-          if (print_progress) {
-            fprintf(stderr, "%5d\b\b\b\b\b", (int)(work_queue->size()));
-          }
-          work = work_queue->front();
-          work_queue->pop_front();
-        }
-        const fs::path final_out = output_store.PathFor(work);
-        const std::string tmp_out = final_out.string() + uniquifier + ".tmp";
-        // Putting the file to clang-tidy early in the command line so that
-        // it is easy to find with `ps` or `top`.
-        const std::string command = clang_tidy_ + " '" + work.first.string() +
-                                    "'" + clang_tidy_args_ + "> '" + tmp_out +
-                                    "' 2>/dev/null";
-        const int r = system(command.c_str());
-#ifdef WIFSIGNALED
-        // NOLINTBEGIN
-        if (WIFSIGNALED(r) &&
-            (WTERMSIG(r) == SIGINT || WTERMSIG(r) == SIGQUIT)) {
-          std::error_code ignored_error;
-          fs::remove(tmp_out, ignored_error);
-          break;  // got Ctrl-C
-        }
-        // NOLINTEND
-#endif
-        const std::string filter_filename = work.first.filename().string();
-        RepairFilenameOccurences(filter_filename, tmp_out, tmp_out);
-        fs::rename(tmp_out, final_out);  // atomic replacement
+    for (const int fd : {out_fds[0], out_fds[1], err_fds[0], err_fds[1]}) {
+      if (fd >= 0) {
+        fcntl(fd, F_SETFD, FD_CLOEXEC);
       }
-    };
+    }
 
-    std::vector<std::thread> workers;
-    for (auto i = 0; i < kJobs; ++i) {
-      workers.emplace_back(clang_tidy_runner);  // NOLINT
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_adddup2(&actions, out_fds[1], STDOUT_FILENO);
+    if (err) {
+      posix_spawn_file_actions_adddup2(&actions, err_fds[1], STDERR_FILENO);
+    } else {
+      posix_spawn_file_actions_addopen(&actions, STDERR_FILENO, "/dev/null",
+                                       O_WRONLY, 0);
     }
-    for (auto &t : workers) {
-      t.join();
+    spawn_error = posix_spawnp(&pid, argv[0], &actions, &attr, argv.data(),
+                               environ);
+    posix_spawn_file_actions_destroy(&actions);
+    close(out_fds[1]);
+    if (err) {
+      close(err_fds[1]);
     }
-    if (print_progress) {
-      fprintf(stderr, "     \n");  // Clean out progress counter.
+  }
+  posix_spawnattr_destroy(&attr);
+  if (spawn_error != 0) {
+    fprintf(stderr, "%s: can't start: %s\n", argv[0], strerror(spawn_error));
+    close(out_fds[0]);
+    if (err) {
+      close(err_fds[0]);
     }
+    return -1;
   }
 
- private:
-  static fs::path GetCacheBaseDir() {
-    if (const char *from_env = getenv("CACHE_DIR")) {
-      return fs::path{from_env};
+  // Read both pipes until they are closed; whichever has data first.
+  struct pollfd fds[2] = {{out_fds[0], POLLIN, 0}, {err_fds[0], POLLIN, 0}};
+  std::string *const sinks[2] = {out, err};
+  const int num_fds = err ? 2 : 1;
+  int open_fds = num_fds;
+  char buf[65536];
+  while (open_fds > 0) {
+    if (poll(fds, num_fds, -1) < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      break;
     }
-    if (const char *home = getenv("HOME")) {
-      if (auto cdir = fs::path(home) / ".cache/"; fs::exists(cdir)) {
-        return cdir;
+    for (int i = 0; i < num_fds; ++i) {
+      if (fds[i].fd < 0 || fds[i].revents == 0) {
+        continue;
+      }
+      const ssize_t r = read(fds[i].fd, buf, sizeof(buf));
+      if (r < 0 && errno == EINTR) {
+        continue;
+      }
+      if (r <= 0) {
+        close(fds[i].fd);
+        fds[i].fd = -1;  // poll() ignores negative fds.
+        --open_fds;
+        continue;
       }
+      sinks[i]->append(buf, r);
     }
-    return fs::path{EnvWithFallback("TMPDIR", "/tmp")};
   }
-
-  static std::string AssembleArgs(int argc, char **argv) {
-    std::string result = " --quiet";
-    result.append(" '--config-file=").append(GetClangTidyConfig()).append("'");
-    for (const std::string_view arg : kExtraArgs) {
-      result.append(" --extra-arg='").append(arg).append("'");
+  for (const struct pollfd &fd : fds) {
+    if (fd.fd >= 0) {
+      close(fd.fd);
     }
-    for (int i = 1; i < argc; ++i) {
-      result.append(" '").append(argv[i]).append("'");
+  }
+
+  int status = 0;
+  struct rusage usage = {};
+  while (wait4(pid, &status, 0, &usage) < 0) {
+    if (errno != EINTR) {
+      return -1;
     }
-    return result;
   }
+  if (max_rss_kb) {
+#ifdef __APPLE__
+    *max_rss_kb = usage.ru_maxrss / 1024;  // Reported in bytes.
+#else
+    *max_rss_kb = usage.ru_maxrss;
+#endif
+  }
+  return status;
+}
 
-  fs::path AssembleProjectCacheDir(const std::string &cache_prefix) const {
-    const fs::path cache_dir = GetCacheBaseDir() / "clang-tidy";
+// Opt-in instrumentation to find out where time is spent. Enabled by
+// setting CLANG_TIDY_TRACE to a filename, which then receives a trace in the
+// Chrome trace_event format (view in chrome://tracing or ui.perfetto.dev)
+// with spans for each phase and each clang-tidy invocation per thread.
+// A summary of the metrics is printed at the end.
+class Tracer {
+ public:
+  using clock = std::chrono::steady_clock;
 
-    // Use major version as part of name of our configuration specific dir.
-    auto version = GetCommandOutput(clang_tidy_ + " --version");
-    if (version.empty()) {
-      std::cerr << "Could not invoke " << clang_tidy_ << "; is it in PATH ?\n";
-      exit(EXIT_FAILURE);
+  static Tracer &Get() {
+    static Tracer sTracer(getenv("CLANG_TIDY_TRACE"));
+    return sTracer;
+  }
+
+  bool enabled() const { return !trace_file_.empty(); }
+
+  // Record span from "start" until now on the calling thread. The "args"
+  // are optional comma-separated JSON key-value pairs.
+  void AddSpan(std::string_view name, std::string_view category,
+               clock::time_point start, std::string_view args = "") {
+    if (!enabled()) {
+      return;
     }
-    std::smatch version_match;
-    const std::string major_version =
-        std::regex_search(version, version_match,
-                          std::regex{"version ([0-9]+)"})
-            ? version_match[1].str()
-            : "UNKNOWN";
+    const int64_t start_us = Micros(start);
+    const int64_t duration_us = Micros(clock::now()) - start_us;
+    std::string event = "{\"name\":\"" + JsonEscape(name) + "\",\"cat\":\"";
+    event.append(category).append("\",\"ph\":\"X\",\"pid\":1,\"tid\":");
+    event.append(std::to_string(ThreadNumber()))
+        .append(",\"ts\":")
+        .append(std::to_string(start_us))
+        .append(",\"dur\":")
+        .append(std::to_string(duration_us));
+    if (!args.empty()) {
+      event.append(",\"args\":{").append(args).append("}");
+    }
+    event.append("}");
+    const std::lock_guard<std::mutex> lock(lock_);
+    events_.push_back(std::move(event));
+  }
 
-    // Make sure directory filename depends on .clang-tidy content.
-    hash_t cache_unique_id = hashContent(version + clang_tidy_args_);
-    cache_unique_id ^= hashContent(GetContent(GetClangTidyConfig()));
-    return cache_dir / fs::path(cache_prefix + "v" + major_version + "_" +
-                                ToHex(cache_unique_id, 8));
+  // Record a span for a phase of the program: from the end of the previous
+  // phase until now.
+  void EndPhase(std::string_view name) {
+    const clock::time_point now = clock::now();
+    AddSpan(name, "phase", phase_start_);
+    phase_start_ = now;
   }
 
-  // Filter clang-tidy output and write only lines that are reported for
-  // the 'interesting_file'. Clang-tidy tends to also report warnings for
-  // some included files, but we're not interested in them.
-  static void FilterCheckLines(std::string_view interesting_file,
-                               const std::string &in, std::ostream &out) {
-    // Extract basename of lines that have a clang-tidy check at end.
-    static const std::regex file_with_tidy(
-        ".*(?:^|/)([^/]+):[0-9]+:[0-9]+:.*"
-        "\\[[a-zA-Z.]+-[a-zA-Z.-]+\\]$");
-
-    // Simple 'awk' - go through each line and output depending on state.
-    bool do_print_line = true;
-    // std::regex is pretty terrible as it does not operate on string-views.
-    // So no point in carefully extracting lines. Might as well use sstream.
-    std::istringstream line_reader(in);
-    std::string line;
-    std::smatch match;
-    while (std::getline(line_reader, line)) {
-      if (std::regex_match(line, match, file_with_tidy)) {
-        do_print_line = (match[1].str() == interesting_file);
-      }
-      if (do_print_line) {
-        out << line << "\n";
-      }
-    }
-  }
-
-  // Fix filename paths found in logfiles that are not emitted relative to
-  // project root in the log - remove that prefix.
-  // (bazel has its own, so if this is bazel, also bazel-specific fix up that).
-  static void RepairFilenameOccurences(std::string_view interesting_file,
-                                       const fs::path &infile,
-                                       const fs::path &outfile) {
-    static const std::regex sFixPathsRe = []() {
-      std::string canonicalize_expr = "(^|\\n)(";  // fix names at start of line
-      if (kConfig.is_bazel_project) {
-        auto bzroot = GetCommandOutput("bazel info execution_root 2>/dev/null");
-        if (!bzroot.empty()) {
-          bzroot.pop_back();  // remove newline.
-          canonicalize_expr += bzroot + "/|";
-        }
-      }
-      canonicalize_expr += fs::current_path().string() + "/";  // $(pwd)/
-      canonicalize_expr +=
-          ")?(\\./)?";  // Some start with, or have a trailing ./
-      return std::regex{canonicalize_expr};
-    }();
+  // Metrics.
+  std::atomic<uint64_t> store_hits{0};
+  std::atomic<uint64_t> store_misses{0};
+  std::atomic<uint64_t> store_bytes_read{0};
+  std::atomic<uint64_t> source_bytes_hashed{0};
+  std::atomic<uint64_t> files_considered{0};
+  std::atomic<uint64_t> files_processed{0};
+  std::atomic<uint64_t> files_from_other_process{0};
 
-    const std::string in_content = GetContent(infile);
-    const std::string canon = std::regex_replace(in_content, sFixPathsRe, "$1");
-    std::fstream out_stream(outfile, std::ios::out);
-    FilterCheckLines(interesting_file, canon, out_stream);
+  void AddJob(std::string_view files, double seconds, uint64_t max_rss_kb) {
+    if (!enabled()) {
+      return;
+    }
+    const std::lock_guard<std::mutex> lock(lock_);
+    jobs_.push_back({std::string(files), seconds, max_rss_kb});
   }
 
-  const std::string clang_tidy_;
-  const std::string clang_tidy_args_;
-  fs::path project_cache_dir_;
-};
-
-class FileGatherer {
- public:
-  FileGatherer(ContentAddressedStore &store, std::string_view search_dir)
-      : store_(store), root_dir_(search_dir.empty() ? "." : search_dir) {}
+  // Write trace file and print summary of the metrics. Starts over
+  // afterwards, so with --watch each round replaces the trace of the
+  // previous one.
+  void Write() {
+    if (!enabled()) {
+      return;
+    }
+    const std::lock_guard<std::mutex> lock(lock_);
+    std::sort(jobs_.begin(), jobs_.end(), [](const Job &a, const Job &b) {
+      return a.seconds > b.seconds;
+    });
+    uint64_t peak_rss_kb = 0;
+    for (const Job &job : jobs_) {
+      peak_rss_kb = std::max(peak_rss_kb, job.max_rss_kb);
+    }
+    const std::pair<const char *, uint64_t> metrics[] = {
+        {"files_considered", files_considered},
+        {"files_processed", files_processed},
+        {"files_from_other_process", files_from_other_process},
+        {"store_hits", store_hits},
+        {"store_misses", store_misses},
+        {"store_bytes_read", store_bytes_read},
+        {"source_bytes_hashed", source_bytes_hashed},
+        {"clang_tidy_invocations", jobs_.size()},
+        {"clang_tidy_peak_rss_kb", peak_rss_kb},
+    };
 
-  // Find all the files we're interested in, and assemble a list of
-  // paths that need refreshing.
-  std::list<filepath_contenthash_t> BuildWorkList(file_time min_freshness) {
-    // Gather all *.cc and *.h files; remember content hashes of includes.
-    static const std::regex include_re(std::string{kConfig.file_include_re});
-    static const std::regex exclude_re(std::string{kConfig.file_exclude_re});
-    std::map<std::string, hash_t> header_hashes;
-    for (const auto &dir_entry : fs::recursive_directory_iterator(root_dir_)) {
-      const fs::path &p = dir_entry.path().lexically_normal();
-      if (!fs::is_regular_file(p)) {
-        continue;
-      }
-      const std::string file = p.string();
-      if (!kConfig.file_include_re.empty() &&
-          !std::regex_search(file, include_re)) {
-        continue;
-      }
-      if (!kConfig.file_exclude_re.empty() &&
-          std::regex_search(file, exclude_re)) {
-        continue;
-      }
-      const auto extension = p.extension();
-      if (ConsiderExtension(extension.string())) {
-        files_of_interest_.emplace_back(p, 0);  // <- hash to be filled later.
+    FILE *out = fopen(trace_file_.c_str(), "wb");
+    if (out) {
+      fprintf(out, "{\"traceEvents\":[\n");
+      for (size_t i = 0; i < events_.size(); ++i) {
+        fprintf(out, "%s%s\n", events_[i].c_str(),
+                i + 1 < events_.size() ? "," : "");
       }
-      // Remember content hash of header, so that we can make changed headers
-      // influence the hash of a file including this.
-      if (kConfig.revisit_if_any_include_changes &&
-          IsIncludeExtension(extension.string())) {
-        // Since the files might be included sloppily without prefix path,
-        // just keep track of the basename (but since there might be collisions,
-        // accomodate all of them by xor-ing the hashes).
-        const std::string just_basename = p.filename();
-        header_hashes[just_basename] ^= hashContent(GetContent(p));
+      fprintf(out, "],\n\"otherData\":{");
+      const char *separator = "";
+      for (const auto &[name, value] : metrics) {
+        fprintf(out, "%s\"%s\":%" PRIu64, separator, name, value);
+        separator = ",";
       }
+      fprintf(out, "}}\n");
+      fclose(out);
     }
-    std::cerr << files_of_interest_.size() << " files of interest.\n";
 
-    // Create content hash address for the cache and build list of work items.
-    // If we want to revisit if headers changed, make hash dependent on them.
-    std::list<filepath_contenthash_t> work_queue;
-    const std::regex inc_re(
-        R"""(#\s*include\s+"([0-9a-zA-Z_/-]+\.[a-zA-Z]+)")""");
-    for (filepath_contenthash_t &work_file : files_of_interest_) {
-      const auto content = GetContent(work_file.first);
-      work_file.second = hashContent(content);
-      if (kConfig.revisit_if_any_include_changes) {
-        // Update the hash with all the hashes from all include files.
-        for (ReIt it(content.begin(), content.end(), inc_re); it != ReIt();
-             ++it) {
-          const std::string &header_path = (*it)[1].str();
-          const std::string header_basename = fs::path(header_path).filename();
-          const auto found = header_hashes.find(header_basename);
-          if (found != header_hashes.end()) {
-            work_file.second ^= found->second;
-          }
-        }
-      }
-      // Recreate if we don't have it yet or if it contains findings but is
-      // older than build environment. Maybe something got fixed: revisit file.
-      if (store_.NeedsRefresh(work_file, min_freshness)) {
-        work_queue.emplace_back(work_file);
+    fprintf(stderr, "---- Metrics (trace in %s) ----\n", trace_file_.c_str());
+    for (const auto &[name, value] : metrics) {
+      fprintf(stderr, "%24s %" PRIu64 "\n", name, value);
+    }
+    const uint64_t lookups = store_hits + store_misses;
+    if (lookups > 0) {
+      fprintf(stderr, "%24s %.1f%%\n", "store_hit_ratio",
+              100.0 * store_hits / lookups);
+    }
+    if (!jobs_.empty()) {
+      fprintf(stderr, "Slowest clang-tidy invocations:\n");
+      for (size_t i = 0; i < std::min<size_t>(jobs_.size(), 10); ++i) {
+        fprintf(stderr, "%8.2fs %8" PRIu64 " KiB  %s\n", jobs_[i].seconds,
+                jobs_[i].max_rss_kb, jobs_[i].files.c_str());
       }
     }
-    return work_queue;
+
+    events_.clear();
+    jobs_.clear();
+    for (std::atomic<uint64_t> *metric :
+         {&store_hits, &store_misses, &store_bytes_read, &source_bytes_hashed,
+          &files_considered, &files_processed, &files_from_other_process}) {
+      *metric = 0;
+    }
   }
 
-  // Tally up findings for files of interest and assemble in one file.
-  // (BuildWorkList() needs to be called first).
-  size_t CreateReport(const fs::path &cache_dir,
-                      std::string_view symlink_detail,
-                      std::string_view symlink_summary) const {
-    // Make it possible to keep independent reports for different invocation
-    // locations (e.g. two checkouts of the same project) using the same cache.
-    const std::string suffix = ToHex(hashContent(fs::current_path().string()));
-    const fs::path tidy_outfile = cache_dir / ("tidy.out-" + suffix);
-    const fs::path tidy_summary = cache_dir / ("tidy-summary.out-" + suffix);
+ private:
+  struct Job {
+    std::string files;
+    double seconds;
+    uint64_t max_rss_kb;
+  };
 
-    // Assemble the separate outputs into a single file. Tally up per-check.
-    // The names have at least one dash in them.
-    const std::regex check_re("(?:^|\n).*(\\[[a-zA-Z.]+-[a-zA-Z.-]+\\])\n");
-    std::map<std::string, int> checks_seen;
-    std::unordered_set<std::string> line_already_seen;  // de-dup
-    std::ofstream tidy_collect(tidy_outfile);
-    for (const filepath_contenthash_t &f : files_of_interest_) {
-      const std::string tidy = store_.GetContentFor(f);
-      if (!tidy.empty()) {
-        tidy_collect << f.first.string() << ":\n" << tidy;
-      }
-      for (ReIt it(tidy.begin(), tidy.end(), check_re); it != ReIt(); ++it) {
-        if (line_already_seen.insert((*it)[0]).second) {
-          checks_seen[(*it)[1].str()]++;
-        }
-      }
-    }
-    tidy_collect.close();
-    std::error_code ignored_error;
-    fs::remove(symlink_detail, ignored_error);
-    fs::create_symlink(tidy_outfile, symlink_detail, ignored_error);
+  explicit Tracer(const char *trace_file)
+      : trace_file_(trace_file ? trace_file : ""),
+        start_(clock::now()),
+        phase_start_(start_) {}
 
-    // Report headline.
-    if (checks_seen.empty()) {
-      std::cerr << "No clang-tidy complaints. 😎\n";
-    } else {
-      std::cerr << "Details: " << symlink_detail << "\n"
-                << "Summary: " << symlink_summary << "\n";
-      std::cerr << "---- Summary ----\n";
-    }
+  int64_t Micros(clock::time_point t) const {
+    return std::chrono::duration_cast<std::chrono::microseconds>(t - start_)
+        .count();
+  }
 
-    // Produce a ordered-by-count report.
-    using check_count_t = std::pair<std::string, int>;
-    std::vector<check_count_t> by_count(checks_seen.begin(), checks_seen.end());
-    std::stable_sort(by_count.begin(), by_count.end(),
-                     [](const check_count_t &a, const check_count_t &b) {
-                       return b.second < a.second;  // reverse count
-                     });
+  static int ThreadNumber() {
+    static std::atomic<int> next_thread{0};
+    thread_local const int number = next_thread++;
+    return number;
+  }
 
-    FILE *summary_file = fopen(tidy_summary.c_str(), "wb");
-    for (const auto &counts : by_count) {
-      fprintf(stdout, "%5d %s\n", counts.second, counts.first.c_str());
-      fprintf(summary_file, "%5d %s\n", counts.second, counts.first.c_str());
+  static std::string JsonEscape(std::string_view in) {
+    std::string result;
+    for (const char c : in) {
+      if (c == '"' || c == '\\') {
+        result.append(1, '\\').append(1, c);
+      } else if (static_cast<unsigned char>(c) < 0x20) {
+        char buf[8];
+        snprintf(buf, sizeof(buf), "\\u%04x", c);
+        result.append(buf);
+      } else {
+        result.append(1, c);
+      }
     }
-    fclose(summary_file);
+    return result;
+  }
 
-    fs::remove(symlink_summary, ignored_error);
-    fs::create_symlink(tidy_summary, symlink_summary, ignored_error);
+  const std::string trace_file_;
+  const clock::time_point start_;
+  clock::time_point phase_start_;
+  std::mutex lock_;
+  std::vector<std::string> events_;
+  std::vector<Job> jobs_;
+};
 
-    return checks_seen.size();
-  }
+// Trace span for the lifetime of this object.
+class ScopedSpan {
+ public:
+  explicit ScopedSpan(std::string_view name,
+                      std::string_view category = "phase")
+      : name_(name), category_(category), start_(Tracer::clock::now()) {}
+  ~ScopedSpan() { Tracer::Get().AddSpan(name_, category_, start_, args_); }
+
+  // Set JSON key-value pairs shown with the span.
+  void SetArgs(std::string args) { args_ = std::move(args); }
 
  private:
-  ContentAddressedStore &store_;
-  const std::string root_dir_;
-  std::vector<filepath_contenthash_t> files_of_interest_;
+  const std::string_view name_;
+  const std::string_view category_;
+  const Tracer::clock::time_point start_;
+  std::string args_;
 };
-}  // namespace
 
-int main(int argc, char *argv[]) {
-  // Test that key files exist and remember their last change.
-  if (!fs::exists(GetClangTidyConfig())) {
-    std::cerr << "Need a " << GetClangTidyConfig() << " config file.\n";
-    return EXIT_FAILURE;
+// Ignore SIGINT and SIGQUIT while alive, just like system() does while
+// waiting for a child. That way, Ctrl-C only terminates the children and
+// we can clean up orderly. It is noted though, so that we can stop waiting
+// for other things.
+class ScopedIgnoreInterrupt {
+ public:
+  ScopedIgnoreInterrupt() {
+    received_ = false;
+    struct sigaction note = {};
+    note.sa_handler = [](int) { received_ = true; };
+    note.sa_flags = SA_RESTART;
+    sigemptyset(&note.sa_mask);
+    sigaction(SIGINT, &note, &old_int_);
+    sigaction(SIGQUIT, &note, &old_quit_);
+  }
+  ~ScopedIgnoreInterrupt() {
+    sigaction(SIGINT, &old_int_, nullptr);
+    sigaction(SIGQUIT, &old_quit_, nullptr);
   }
 
-  std::error_code ec;
-  const auto toplevel_build_ts =
-      fs::last_write_time(kConfig.toplevel_build_file, ec);
-  if (ec.value() != 0) {
-    std::cerr << "Script needs to be executed in toplevel project dir.\n";
+  // If Ctrl-C was pressed while alive.
+  bool received() const { return received_; }
+
+ private:
+  static inline std::atomic<bool> received_ = false;
+  struct sigaction old_int_ = {};
+  struct sigaction old_quit_ = {};
+};
+
+hash_t hashContent(const std::string &s) { return std::hash<std::string>()(s); }
+std::string ToHex(uint64_t value, int show_lower_nibbles = 16) {
+  char out[16 + 1];
+  snprintf(out, sizeof(out), "%016" PRIx64, value);
+  return out + (16 - show_lower_nibbles);
+}
+
+// Mapping filepath_contenthash_t to stored content. Implementations decide
+// where to actually keep it.
+class ContentAddressedStore {
+ public:
+  virtual ~ContentAddressedStore() = default;
+
+  // Return content stored for filepath contenthash; empty optional if not
+  // there. The suffix allows to store auxiliary data for the same key.
+  std::optional<std::string> Lookup(const filepath_contenthash_t &c,
+                                    std::string_view suffix = "") const {
+    std::string key = KeyFor(c, suffix);
+    std::optional<std::string> result = LookupKey(key);
+    Tracer &tracer = Tracer::Get();
+    if (result) {
+      ++tracer.store_hits;
+      tracer.store_bytes_read += result->size();
+      const std::lock_guard<std::mutex> lock(access_lock_);
+      accessed_.insert(std::move(key));
+    } else {
+      ++tracer.store_misses;
+    }
+    return result;
+  }
+
+  // Store content for given filepath contenthash. Readers never see a
+  // partially written entry.
+  void Store(const filepath_contenthash_t &c, std::string_view content,
+             std::string_view suffix = "") {
+    StoreKey(KeyFor(c, suffix), content);
+  }
+
+  // Check if this needs to be recreated, either because it is not there,
+  // or is not empty and does not fit freshness requirements.
+  bool NeedsRefresh(const filepath_contenthash_t &c,
+                    file_time min_freshness) const {
+    const std::optional<EntryInfo> info = InfoForKey(KeyFor(c, ""));
+    if (!info) {
+      return true;  // Not there.
+    }
+
+    // If file exists but is broken (i.e. has a non-zero size with messages),
+    // consider recreating if if older than compilation db.
+    const bool timestamp_trigger =
+        kConfig.revisit_brokenfiles_if_build_config_newer &&
+        (info->size > 0 && info->write_time < min_freshness);
+    return timestamp_trigger;
+  }
+
+  // An entry as seen by the garbage collector.
+  struct EntryStat {
+    std::string key;
+    uint64_t disk_size;
+    int64_t last_access;  // Seconds since epoch.
+  };
+
+  // Persist the access time of all entries looked up so far. This is the
+  // basis for least-recently-used eviction.
+  void FlushAccessTimes() {
+    std::vector<std::string> keys;
+    {
+      const std::lock_guard<std::mutex> lock(access_lock_);
+      keys.assign(accessed_.begin(), accessed_.end());
+      accessed_.clear();
+    }
+    UpdateAccessTimes(keys, time(nullptr));
+  }
+
+  // List all entries; only to be called while no other process uses the
+  // store.
+  virtual std::vector<EntryStat> ListEntries() const = 0;
+
+  // Remove the entries with the given keys; only to be called while no other
+  // process uses the store.
+  virtual void Remove(const std::unordered_set<std::string> &keys) = 0;
+
+ protected:
+  struct EntryInfo {
+    uint64_t size;
+    file_time write_time;
+  };
+
+  // Name is human readable, the content hash makes it unique.
+  static std::string KeyFor(const filepath_contenthash_t &c,
+                            std::string_view suffix) {
+    std::string name_with_contenthash = c.first.filename().string();
+    name_with_contenthash.append("-").append(ToHex(c.second)).append(suffix);
+    return name_with_contenthash;
+  }
+
+  virtual std::optional<std::string> LookupKey(
+      const std::string &key) const = 0;
+  virtual void StoreKey(const std::string &key, std::string_view content) = 0;
+  virtual std::optional<EntryInfo> InfoForKey(
+      const std::string &key) const = 0;
+  virtual void UpdateAccessTimes(const std::vector<std::string> &keys,
+                                 int64_t now) = 0;
+
+ private:
+  mutable std::mutex access_lock_;
+  mutable std::unordered_set<std::string> accessed_;
+};
+
+// Each entry is a file in the contents/ directory.
+class FileContentStore : public ContentAddressedStore {
+ public:
+  explicit FileContentStore(const fs::path &project_base_dir)
+      : content_dir(project_base_dir / "contents") {
+    fs::create_directories(content_dir);
+  }
+
+  std::vector<EntryStat> ListEntries() const final {
+    std::vector<EntryStat> result;
+    std::error_code ec;
+    for (const auto &entry : fs::directory_iterator(content_dir, ec)) {
+      struct stat st;
+      if (stat(entry.path().c_str(), &st) == 0) {
+        result.push_back({entry.path().filename().string(),
+                          static_cast<uint64_t>(st.st_size), st.st_atime});
+      }
+    }
+    return result;
+  }
+
+  void Remove(const std::unordered_set<std::string> &keys) final {
+    std::error_code ignored_error;
+    for (const std::string &key : keys) {
+      fs::remove(content_dir / key, ignored_error);
+    }
+  }
+
+ protected:
+  std::optional<std::string> LookupKey(const std::string &key) const final {
+    FILE *f = fopen((content_dir / key).string().c_str(), "rb");
+    if (!f) {
+      return std::nullopt;
+    }
+    return GetContent(f);
+  }
+
+  // Written to a temporary file first, then atomically renamed.
+  void StoreKey(const std::string &key, std::string_view content) final {
+    const fs::path final_out = content_dir / key;
+    const std::string tmp_out =
+        final_out.string() + "." + std::to_string(getpid()) + ".tmp";
+    FILE *out = fopen(tmp_out.c_str(), "wb");
+    if (!out) {
+      fprintf(stderr, "%s: can't write: %s\n", tmp_out.c_str(),
+              strerror(errno));
+      return;
+    }
+    const bool success =
+        fwrite(content.data(), 1, content.size(), out) == content.size();
+    if (fclose(out) != 0 || !success) {
+      std::error_code ignored_error;
+      fs::remove(tmp_out, ignored_error);
+      return;
+    }
+    fs::rename(tmp_out, final_out);  // atomic replacement
+  }
+
+  std::optional<EntryInfo> InfoForKey(const std::string &key) const final {
+    const fs::path content_hash_file = content_dir / key;
+    std::error_code ec;
+    const auto size = fs::file_size(content_hash_file, ec);
+    if (ec) {
+      return std::nullopt;
+    }
+    // Only needed for non-empty files, so avoid the stat() otherwise.
+    return EntryInfo{size, size == 0 ? file_time::max()
+                                     : fs::last_write_time(content_hash_file)};
+  }
+
+  // The access time of the file is the last access; explicitly set, as
+  // file systems are often mounted with noatime or relatime.
+  void UpdateAccessTimes(const std::vector<std::string> &keys,
+                         int64_t) final {
+    const struct timespec times[2] = {{0, UTIME_NOW}, {0, UTIME_OMIT}};
+    for (const std::string &key : keys) {
+      utimensat(AT_FDCWD, (content_dir / key).c_str(), times, 0);
+    }
+  }
+
+ private:
+  const fs::path content_dir;
+};
+
+// Simple LZ77 compression in the spirit of the LZ4 block format: sequences
+// of a token (nibbles: literal length, match length - 4), optional length
+// extension bytes, literals, and a 16 bit back-reference offset. Good
+// enough to shrink the very repetitive clang-tidy output.
+namespace lz {
+constexpr size_t kMinMatch = 4;
+
+inline void PutLength(std::string *out, size_t len) {
+  for (; len >= 255; len -= 255) {
+    out->push_back(static_cast<char>(255));
+  }
+  out->push_back(static_cast<char>(len));
+}
+
+std::string Compress(std::string_view in) {
+  std::string out;
+  uint32_t table[4096] = {};  // Position + 1 of last occurence of 4 bytes.
+  size_t literal_start = 0;
+  size_t pos = 0;
+  auto emit = [&](size_t match_len, size_t offset) {
+    const size_t literal_len = pos - literal_start;
+    const size_t match_code = match_len ? match_len - kMinMatch : 0;
+    out.push_back(static_cast<char>((std::min<size_t>(literal_len, 15) << 4) |
+                                    std::min<size_t>(match_code, 15)));
+    if (literal_len >= 15) {
+      PutLength(&out, literal_len - 15);
+    }
+    out.append(in.substr(literal_start, literal_len));
+    if (match_len) {
+      out.push_back(static_cast<char>(offset & 0xff));
+      out.push_back(static_cast<char>(offset >> 8));
+      if (match_code >= 15) {
+        PutLength(&out, match_code - 15);
+      }
+    }
+  };
+  while (pos + kMinMatch <= in.size()) {
+    uint32_t four;
+    memcpy(&four, in.data() + pos, sizeof(four));
+    const uint32_t slot = (four * 2654435761U) >> 20;
+    const size_t candidate = table[slot];
+    table[slot] = pos + 1;
+    if (candidate == 0 || pos + 1 - candidate > 0xffff ||
+        memcmp(in.data() + candidate - 1, in.data() + pos, kMinMatch) != 0) {
+      ++pos;
+      continue;
+    }
+    size_t match_len = kMinMatch;
+    while (pos + match_len < in.size() &&
+           in[candidate - 1 + match_len] == in[pos + match_len]) {
+      ++match_len;
+    }
+    emit(match_len, pos + 1 - candidate);
+    pos += match_len;
+    literal_start = pos;
+  }
+  pos = in.size();
+  emit(0, 0);  // Remaining literals.
+  return out;
+}
+
+// Returns empty optional on corrupt input.
+std::optional<std::string> Decompress(std::string_view in, size_t out_len) {
+  std::string out;
+  out.reserve(out_len);
+  size_t pos = 0;
+  auto get_length = [&](size_t len) -> size_t {
+    if (len < 15) {
+      return len;
+    }
+    for (uint8_t b = 255; b == 255 && pos < in.size();) {
+      b = in[pos++];
+      len += b;
+    }
+    return len;
+  };
+  while (pos < in.size()) {
+    const uint8_t token = in[pos++];
+    const size_t literal_len = get_length(token >> 4);
+    if (pos + literal_len > in.size()) {
+      return std::nullopt;
+    }
+    out.append(in.substr(pos, literal_len));
+    pos += literal_len;
+    if (pos == in.size()) {
+      break;  // Last sequence only has literals.
+    }
+    if (pos + 2 > in.size()) {
+      return std::nullopt;
+    }
+    const size_t offset = uint8_t(in[pos]) | (uint8_t(in[pos + 1]) << 8);
+    pos += 2;
+    const size_t match_len = get_length(token & 0x0f) + kMinMatch;
+    if (offset == 0 || offset > out.size()) {
+      return std::nullopt;
+    }
+    for (size_t i = 0; i < match_len; ++i) {  // Might overlap; byte by byte.
+      out.push_back(out[out.size() - offset]);
+    }
+  }
+  if (out.size() != out_len) {
+    return std::nullopt;
+  }
+  return out;
+}
+}  // namespace lz
+
+// All entries in a single append-only pack file with an on-disk hash index,
+// so that there is no need for an inode per entry and lookups are O(1).
+// Both files are memory mapped, so reading many entries, e.g. for a report,
+// does not need any system calls.
+//
+// Optionally, larger entries are compressed if that saves space. Records
+// are flagged, so that stores can be read with either setting.
+//
+// Concurrent invocations can safely share the store: appending a record and
+// updating the index happens while holding an exclusive flock() on the pack.
+// Records are only added to the index once fully written and carry a
+// checksum, so readers never observe partial entries.
+class PackedContentStore : public ContentAddressedStore {
+ public:
+  PackedContentStore(const fs::path &project_base_dir, bool compress)
+      : pack_file_(project_base_dir / "packed" / "store.pack"),
+        index_file_(project_base_dir / "packed" / "store.idx"),
+        compress_(compress) {
+    fs::create_directories(pack_file_.parent_path());
+    pack_fd_ = open(pack_file_.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (pack_fd_ < 0) {
+      fprintf(stderr, "%s: can't open: %s\n", pack_file_.c_str(),
+              strerror(errno));
+      exit(EXIT_FAILURE);
+    }
+    flock(pack_fd_, LOCK_EX);
+    OpenIndex();
+    flock(pack_fd_, LOCK_UN);
+    RemapPack();
+  }
+
+  ~PackedContentStore() override {
+    Unmap(&pack_map_);
+    Unmap(&index_map_);
+    close(index_fd_);
+    close(pack_fd_);
+  }
+
+ protected:
+  std::optional<std::string> LookupKey(const std::string &key) const final {
+    std::shared_lock<std::shared_mutex> lock(mutex_);
+    const Record *record = FindRecordUpToDate(key, &lock);
+    if (!record) {
+      return std::nullopt;
+    }
+    const std::string_view stored = StoredContent(record);
+    if (record->flags & kCompressed) {
+      return lz::Decompress(stored, record->content_len);
+    }
+    return std::string(stored);
+  }
+
+  void StoreKey(const std::string &key, std::string_view content) final {
+    std::string compressed;
+    Record header;
+    header.key_len = key.size();
+    header.content_len = content.size();
+    header.write_time = file_time::clock::now().time_since_epoch().count();
+    if (compress_ && content.size() >= kCompressMinSize) {
+      compressed = lz::Compress(content);
+      if (compressed.size() < content.size() * 9 / 10) {
+        content = compressed;
+        header.flags |= kCompressed;
+      }
+    }
+    header.stored_len = content.size();
+
+    std::string buffer(sizeof(header), '\0');
+    buffer.append(key).append(content);
+    header.checksum = Checksum(key, content);
+    memcpy(buffer.data(), &header, sizeof(header));
+    buffer.resize((buffer.size() + 7) & ~size_t{7});  // Keep records aligned.
+
+    const std::unique_lock<std::shared_mutex> lock(mutex_);
+    flock(pack_fd_, LOCK_EX);
+    ReopenIndexIfReplaced();
+    const off_t offset = lseek(pack_fd_, 0, SEEK_END);
+    if (offset >= 0 && WriteFully(pack_fd_, buffer)) {
+      // If it can't be indexed, the record is unreferenced: a miss next time.
+      Insert(KeyHash(key), offset, key);
+    } else {
+      fprintf(stderr, "%s: can't write: %s\n", pack_file_.c_str(),
+              strerror(errno));
+      if (offset >= 0 && ftruncate(pack_fd_, offset) != 0) {
+        // Nothing we can do. The partial record is not referenced anyway.
+      }
+    }
+    flock(pack_fd_, LOCK_UN);
+  }
+
+  std::optional<EntryInfo> InfoForKey(const std::string &key) const final {
+    std::shared_lock<std::shared_mutex> lock(mutex_);
+    const Record *record = FindRecordUpToDate(key, &lock);
+    if (!record) {
+      return std::nullopt;
+    }
+    return EntryInfo{record->content_len,
+                     file_time(file_time::duration(record->write_time))};
+  }
+
+  void UpdateAccessTimes(const std::vector<std::string> &keys,
+                         int64_t now) final {
+    const std::unique_lock<std::shared_mutex> lock(mutex_);
+    flock(pack_fd_, LOCK_EX);
+    ReopenIndexIfReplaced();
+    RemapPack();
+    for (const std::string &key : keys) {
+      if (Slot *slot = FindSlot(key)) {
+        slot->last_access = now;
+      }
+    }
+    flock(pack_fd_, LOCK_UN);
+  }
+
+ public:
+  std::vector<EntryStat> ListEntries() const final {
+    const std::unique_lock<std::shared_mutex> lock(mutex_);
+    RemapPack();
+    std::vector<EntryStat> result;
+    for (uint64_t i = 0; i < index_header()->slot_count; ++i) {
+      const Slot &slot = slots()[i];
+      if (const Record *record = RecordAt(slot)) {
+        result.push_back({std::string(RecordKey(record)), RecordSize(record),
+                          static_cast<int64_t>(slot.last_access)});
+      }
+    }
+    return result;
+  }
+
+  // Compact the pack: write all remaining records to a new pack with
+  // a new index and atomically replace the current ones.
+  void Remove(const std::unordered_set<std::string> &keys) final {
+    const std::unique_lock<std::shared_mutex> lock(mutex_);
+    flock(pack_fd_, LOCK_EX);
+    ReopenIndexIfReplaced();
+    RemapPack();
+    std::vector<const Slot *> keep;
+    for (uint64_t i = 0; i < index_header()->slot_count; ++i) {
+      const Record *record = RecordAt(slots()[i]);
+      if (record && !keys.count(std::string(RecordKey(record)))) {
+        keep.push_back(&slots()[i]);
+      }
+    }
+    uint64_t slot_count = kInitialSlots;
+    while (slot_count < keep.size() * 2) {
+      slot_count *= 2;
+    }
+    const std::string suffix = "." + std::to_string(getpid()) + ".tmp";
+    const std::string tmp_pack = pack_file_.string() + suffix;
+    const std::string tmp_index = index_file_.string() + suffix;
+    const int pack_fd =
+        open(tmp_pack.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    const int index_fd = CreateIndex(tmp_index, slot_count);
+    Mapping new_index;
+    bool success = pack_fd >= 0 && index_fd >= 0 &&
+                   Map(index_fd, PROT_READ | PROT_WRITE, &new_index);
+    if (success) {
+      auto *header = static_cast<IndexHeader *>(new_index.data);
+      auto *new_slots = reinterpret_cast<Slot *>(header + 1);
+      uint64_t offset = 0;
+      for (const Slot *slot : keep) {
+        const Record *record = RecordAt(*slot);
+        const std::string_view bytes(reinterpret_cast<const char *>(record),
+                                     RecordSize(record));
+        if (!WriteFully(pack_fd, bytes)) {
+          success = false;
+          break;
+        }
+        uint64_t i = slot->key_hash & (slot_count - 1);
+        while (new_slots[i].offset_plus_one != 0) {
+          i = (i + 1) & (slot_count - 1);
+        }
+        new_slots[i] = {slot->key_hash, offset + 1, slot->last_access};
+        ++header->used;
+        offset += bytes.size();
+      }
+      Unmap(&new_index);
+    }
+    if (success) {
+      // A crash in-between is not a problem: records won't validate with the
+      // old index and are just considered missing.
+      fs::rename(tmp_pack, pack_file_);
+      fs::rename(tmp_index, index_file_);
+      flock(pack_fd, LOCK_EX);
+      flock(pack_fd_, LOCK_UN);
+      close(pack_fd_);
+      pack_fd_ = pack_fd;
+      ReopenIndexIfReplaced();
+      RemapPack();
+      close(index_fd);
+    } else {
+      fprintf(stderr, "%s: compaction failed.\n", pack_file_.c_str());
+      std::error_code ignored_error;
+      fs::remove(tmp_pack, ignored_error);
+      fs::remove(tmp_index, ignored_error);
+      if (pack_fd >= 0) {
+        close(pack_fd);
+      }
+      if (index_fd >= 0) {
+        close(index_fd);
+      }
+    }
+    flock(pack_fd_, LOCK_UN);
+  }
+
+ private:
+  static constexpr uint32_t kMagic = 0x4b505443;  // "CTPK"
+  static constexpr uint32_t kCompressed = 1;
+  static constexpr size_t kCompressMinSize = 256;
+  static constexpr uint64_t kInitialSlots = 1024;
+
+  struct Record {
+    uint32_t magic = kMagic;
+    uint32_t flags = 0;
+    uint32_t key_len = 0;
+    uint32_t stored_len = 0;   // Bytes following the key.
+    uint32_t content_len = 0;  // Uncompressed size.
+    uint32_t reserved = 0;
+    int64_t write_time = 0;
+    uint64_t checksum = 0;  // Over key and stored content.
+  };
+
+  struct IndexHeader {
+    uint64_t magic = kMagic;
+    uint64_t slot_count = 0;  // Power of two.
+    uint64_t used = 0;
+    uint64_t reserved = 0;
+  };
+
+  // Open addressing with linear probing. Slots are written offset first,
+  // then key hash, so a concurrent reader never follows a half-set slot.
+  struct Slot {
+    uint64_t key_hash;
+    uint64_t offset_plus_one;  // Zero: empty.
+    uint64_t last_access;      // Seconds since epoch.
+  };
+
+  struct Mapping {
+    void *data = nullptr;
+    size_t size = 0;
+  };
+
+  static uint64_t KeyHash(std::string_view key) {
+    return std::hash<std::string_view>()(key) | 1;  // Never zero.
+  }
+
+  static uint64_t Checksum(std::string_view key, std::string_view content) {
+    return std::hash<std::string_view>()(key) * 31 +
+           std::hash<std::string_view>()(content);
+  }
+
+  static std::string_view RecordKey(const Record *record) {
+    return {reinterpret_cast<const char *>(record + 1), record->key_len};
+  }
+
+  static std::string_view StoredContent(const Record *record) {
+    return {reinterpret_cast<const char *>(record + 1) + record->key_len,
+            record->stored_len};
+  }
+
+  // Size including padding.
+  static uint64_t RecordSize(const Record *record) {
+    return (sizeof(Record) + record->key_len + record->stored_len + 7) &
+           ~uint64_t{7};
+  }
+
+  static bool WriteFully(int fd, std::string_view data) {
+    while (!data.empty()) {
+      const ssize_t w = write(fd, data.data(), data.size());
+      if (w < 0 && errno == EINTR) {
+        continue;
+      }
+      if (w <= 0) {
+        return false;
+      }
+      data.remove_prefix(w);
+    }
+    return true;
+  }
+
+  static void Unmap(Mapping *m) {
+    if (m->data) {
+      munmap(m->data, m->size);
+    }
+    *m = {};
+  }
+
+  static bool Map(int fd, int prot, Mapping *m) {
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+      return false;
+    }
+    void *data = mmap(nullptr, st.st_size, prot, MAP_SHARED, fd, 0);
+    if (data == MAP_FAILED) {
+      return false;
+    }
+    *m = {data, static_cast<size_t>(st.st_size)};
+    return true;
+  }
+
+  size_t PackSize() const {
+    struct stat st;
+    return fstat(pack_fd_, &st) == 0 ? st.st_size : 0;
+  }
+
+  void RemapPack() const {
+    Unmap(&pack_map_);
+    Map(pack_fd_, PROT_READ, &pack_map_);
+  }
+
+  IndexHeader *index_header() const {
+    return static_cast<IndexHeader *>(index_map_.data);
+  }
+  Slot *slots() const { return reinterpret_cast<Slot *>(index_header() + 1); }
+
+  // Validated record referenced by slot in mapped pack or nullptr if empty,
+  // out of range or corrupt.
+  const Record *RecordAt(const Slot &slot) const {
+    const uint64_t offset = slot.offset_plus_one - 1;
+    if (slot.offset_plus_one == 0 || offset + sizeof(Record) > pack_map_.size) {
+      return nullptr;
+    }
+    const auto *record = reinterpret_cast<const Record *>(
+        static_cast<const char *>(pack_map_.data) + offset);
+    if (record->magic != kMagic ||
+        offset + sizeof(Record) + record->key_len + record->stored_len >
+            pack_map_.size) {
+      return nullptr;
+    }
+    if (Checksum(RecordKey(record), StoredContent(record)) !=
+        record->checksum) {
+      return nullptr;
+    }
+    return record;
+  }
+
+  Slot *FindSlot(std::string_view key) const {
+    if (!index_map_.data) {
+      return nullptr;
+    }
+    const uint64_t hash = KeyHash(key);
+    const uint64_t slot_count = index_header()->slot_count;
+    const uint64_t mask = slot_count - 1;
+    uint64_t i = hash & mask;
+    for (uint64_t probe = 0; probe < slot_count; ++probe, i = (i + 1) & mask) {
+      Slot &slot = slots()[i];
+      if (slot.offset_plus_one == 0) {
+        return nullptr;
+      }
+      if (slot.key_hash == hash) {
+        const Record *record = RecordAt(slot);
+        if (record && RecordKey(record) == key) {
+          return &slot;
+        }
+      }
+    }
+    return nullptr;  // Table full.
+  }
+
+  const Record *FindRecord(std::string_view key) const {
+    const Slot *slot = FindSlot(key);
+    return slot ? RecordAt(*slot) : nullptr;
+  }
+
+  // As FindRecord(), but on a miss first catch up with other processes:
+  // they might have appended to the pack or replaced the index since.
+  // Called with "lock" held, which is released while remapping.
+  const Record *FindRecordUpToDate(
+      std::string_view key, std::shared_lock<std::shared_mutex> *lock) const {
+    const Record *record = FindRecord(key);
+    if (record || (pack_map_.size >= PackSize() && !IndexReplaced())) {
+      return record;
+    }
+    lock->unlock();
+    {
+      const std::unique_lock<std::shared_mutex> remap_lock(mutex_);
+      flock(pack_fd_, LOCK_SH);
+      ReopenIndexIfReplaced();
+      RemapPack();
+      flock(pack_fd_, LOCK_UN);
+    }
+    lock->lock();
+    return FindRecord(key);
+  }
+
+  // Key of the record at given offset, read from file as it might not be
+  // mapped yet.
+  std::string ReadKeyAt(uint64_t offset) const {
+    Record record;
+    if (pread(pack_fd_, &record, sizeof(record), offset) != sizeof(record)) {
+      return {};
+    }
+    std::string key(record.key_len, '\0');
+    if (pread(pack_fd_, key.data(), key.size(), offset + sizeof(record)) !=
+        static_cast<ssize_t>(key.size())) {
+      return {};
+    }
+    return key;
+  }
+
+  // Needs to be called with exclusive locks held. Returns false if the
+  // index is at its load limit and could not be grown.
+  bool Insert(uint64_t hash, uint64_t offset, std::string_view key) {
+    if ((index_header()->used + 1) * 2 > index_header()->slot_count &&
+        !Grow()) {
+      return false;
+    }
+    const uint64_t slot_count = index_header()->slot_count;
+    const uint64_t mask = slot_count - 1;
+    uint64_t i = hash & mask;
+    for (uint64_t probe = 0; probe < slot_count; ++probe, i = (i + 1) & mask) {
+      Slot &slot = slots()[i];
+      if (slot.offset_plus_one == 0) {
+        slot.last_access = time(nullptr);
+        slot.offset_plus_one = offset + 1;
+        slot.key_hash = hash;
+        ++index_header()->used;
+        return true;
+      }
+      if (slot.key_hash == hash && ReadKeyAt(slot.offset_plus_one - 1) == key) {
+        slot.last_access = time(nullptr);
+        slot.offset_plus_one = offset + 1;  // Replace with newer record.
+        return true;
+      }
+    }
+    return false;
+  }
+
+  // Create new index with twice the number of slots and atomically replace
+  // the current one. Needs to be called with exclusive locks held.
+  bool Grow() {
+    const uint64_t new_slot_count = 2 * index_header()->slot_count;
+    const std::string tmp_file =
+        index_file_.string() + "." + std::to_string(getpid()) + ".tmp";
+    const int fd = CreateIndex(tmp_file, new_slot_count);
+    Mapping new_map;
+    if (fd < 0 || !Map(fd, PROT_READ | PROT_WRITE, &new_map)) {
+      if (fd >= 0) {
+        close(fd);
+      }
+      unlink(tmp_file.c_str());
+      return false;
+    }
+    auto *new_header = static_cast<IndexHeader *>(new_map.data);
+    auto *new_slots = reinterpret_cast<Slot *>(new_header + 1);
+    const uint64_t mask = new_slot_count - 1;
+    for (uint64_t s = 0; s < index_header()->slot_count; ++s) {
+      const Slot &slot = slots()[s];
+      if (slot.offset_plus_one == 0) {
+        continue;
+      }
+      uint64_t i = slot.key_hash & mask;
+      while (new_slots[i].offset_plus_one != 0) {
+        i = (i + 1) & mask;
+      }
+      new_slots[i] = slot;
+      ++new_header->used;
+    }
+    std::error_code ec;
+    fs::rename(tmp_file, index_file_, ec);  // atomic replacement
+    if (ec) {
+      Unmap(&new_map);
+      close(fd);
+      unlink(tmp_file.c_str());
+      return false;
+    }
+    Unmap(&index_map_);
+    close(index_fd_);
+    index_fd_ = fd;
+    index_map_ = new_map;
+    return true;
+  }
+
+  static int CreateIndex(const std::string &file, uint64_t slot_count) {
+    const int fd = open(file.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC,
+                        0644);
+    if (fd < 0) {
+      return fd;
+    }
+    IndexHeader header;
+    header.slot_count = slot_count;
+    if (ftruncate(fd, sizeof(header) + slot_count * sizeof(Slot)) != 0 ||
+        pwrite(fd, &header, sizeof(header), 0) != sizeof(header)) {
+      close(fd);
+      return -1;
+    }
+    return fd;
+  }
+
+  // Needs to be called with flock() held.
+  void OpenIndex() const {
+    index_fd_ = open(index_file_.c_str(), O_RDWR | O_CLOEXEC);
+    if (index_fd_ < 0) {
+      index_fd_ = CreateIndex(index_file_, kInitialSlots);
+    }
+    if (index_fd_ < 0 || !Map(index_fd_, PROT_READ | PROT_WRITE, &index_map_) ||
+        index_map_.size < sizeof(IndexHeader) ||
+        index_header()->magic != kMagic) {
+      fprintf(stderr, "%s: can't use index.\n", index_file_.c_str());
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  // Another process might have grown the index.
+  bool IndexReplaced() const {
+    struct stat by_name;
+    struct stat by_fd;
+    return stat(index_file_.c_str(), &by_name) != 0 ||
+           fstat(index_fd_, &by_fd) != 0 || by_name.st_ino != by_fd.st_ino;
+  }
+
+  // Needs flock() held.
+  void ReopenIndexIfReplaced() const {
+    if (!IndexReplaced()) {
+      return;
+    }
+    Unmap(&index_map_);
+    close(index_fd_);
+    OpenIndex();
+  }
+
+  const fs::path pack_file_;
+  const fs::path index_file_;
+  const bool compress_;
+  int pack_fd_ = -1;
+  mutable int index_fd_ = -1;
+
+  // Shared for lookups, exclusive for modifications (including remapping).
+  mutable std::shared_mutex mutex_;
+  mutable Mapping pack_map_;
+  mutable Mapping index_map_;
+};
+
+// Thread-safe memoization of file content hashes, so that headers shared by
+// many translation units are only read once.
+//
+// Hashes are persisted in an index together with the stat() information of
+// the file at the time it was hashed (similar to the git index). Files whose
+// mtime, size and inode are unchanged since then are not read again.
+class ContentHasher {
+ public:
+  explicit ContentHasher(const fs::path &index_file)
+      : index_file_(index_file) {
+    LoadIndex();
+  }
+
+  // Return content hash of file; 0 if it does not exist.
+  hash_t HashOf(const fs::path &file) {
+    const std::string key = file.string();
+    {
+      const std::lock_guard<std::mutex> lock(lock_);
+      const auto found = hashes_.find(key);
+      if (found != hashes_.end()) {
+        return found->second.hash;
+      }
+    }
+    IndexEntry entry;
+    if (!GetStat(key, &entry)) {
+      return 0;
+    }
+    const auto indexed = index_.find(key);  // Read-only after LoadIndex().
+    if (indexed != index_.end() && indexed->second.SameStat(entry) &&
+        entry.mtime_ns / kNanos < index_mtime_seconds_) {
+      entry.hash = indexed->second.hash;
+    } else {
+      entry.hash = hashContent(GetContent(file));
+      Tracer::Get().source_bytes_hashed += entry.size;
+    }
+    const std::lock_guard<std::mutex> lock(lock_);
+    hashes_[key] = entry;
+    return entry.hash;
+  }
+
+  // Forget the hash of the file, e.g. because it changed.
+  void Forget(const fs::path &file) {
+    const std::lock_guard<std::mutex> lock(lock_);
+    hashes_.erase(file.string());
+  }
+
+  // Files and their hashes as of the last run that saved the index.
+  std::vector<filepath_contenthash_t> IndexedFiles() const {
+    std::vector<filepath_contenthash_t> result;
+    result.reserve(index_.size());
+    for (const auto &[file, e] : index_) {
+      result.emplace_back(file, e.hash);
+    }
+    return result;
+  }
+
+  // Persist hashes of all files seen in this run. If only a subset of files
+  // was looked at, "keep_unseen" retains the others from the previous index.
+  void SaveIndex(bool keep_unseen = false) const {
+    const std::string tmp_file =
+        index_file_.string() + "." + std::to_string(getpid()) + ".tmp";
+    FILE *out = fopen(tmp_file.c_str(), "wb");
+    if (!out) {
+      return;  // Best effort. Next time we just have to hash again.
+    }
+    const std::lock_guard<std::mutex> lock(lock_);
+    auto write_entry = [out](const std::string &file, const IndexEntry &e) {
+      fprintf(out, "%016" PRIx64 " %" PRId64 " %" PRIu64 " %" PRIu64 " %s\n",
+              e.hash, e.mtime_ns, e.size, e.inode, file.c_str());
+    };
+    for (const auto &[file, e] : hashes_) {
+      write_entry(file, e);
+    }
+    for (const auto &[file, e] : index_) {
+      if (keep_unseen && hashes_.find(file) == hashes_.end()) {
+        write_entry(file, e);
+      }
+    }
+    if (fclose(out) == 0) {
+      fs::rename(tmp_file, index_file_);  // atomic replacement
+    }
+  }
+
+ private:
+  static constexpr int64_t kNanos = 1'000'000'000;
+
+  struct IndexEntry {
+    hash_t hash = 0;
+    int64_t mtime_ns = 0;
+    uint64_t size = 0;
+    uint64_t inode = 0;
+
+    bool SameStat(const IndexEntry &other) const {
+      return mtime_ns == other.mtime_ns && size == other.size &&
+             inode == other.inode;
+    }
+  };
+
+  static bool GetStat(const std::string &file, IndexEntry *entry) {
+    struct stat st;
+    if (stat(file.c_str(), &st) != 0 || !S_ISREG(st.st_mode)) {
+      return false;
+    }
+#ifdef __APPLE__
+    const struct timespec &mtime = st.st_mtimespec;
+#else
+    const struct timespec &mtime = st.st_mtim;
+#endif
+    entry->mtime_ns = int64_t{mtime.tv_sec} * kNanos + mtime.tv_nsec;
+    entry->size = st.st_size;
+    entry->inode = st.st_ino;
+    return true;
+  }
+
+  void LoadIndex() {
+    FILE *in = fopen(index_file_.string().c_str(), "rb");
+    if (!in) {
+      return;
+    }
+    // Files modified in the same second the index was written might have
+    // been modified after they were hashed without a visible change in
+    // mtime. These are 'racily clean' and can't be trusted.
+    struct stat st;
+    index_mtime_seconds_ = (fstat(fileno(in), &st) == 0) ? st.st_mtime : 0;
+    char line[4096];
+    while (fgets(line, sizeof(line), in)) {
+      IndexEntry e;
+      int path_start = 0;
+      if (sscanf(line, "%" SCNx64 " %" SCNd64 " %" SCNu64 " %" SCNu64 " %n",
+                 &e.hash, &e.mtime_ns, &e.size, &e.inode, &path_start) < 4 ||
+          path_start == 0) {
+        continue;
+      }
+      std::string file(line + path_start);
+      if (!file.empty() && file.back() == '\n') {
+        file.pop_back();
+      }
+      index_.emplace(std::move(file), e);
+    }
+    fclose(in);
+  }
+
+  const fs::path index_file_;
+  std::unordered_map<std::string, IndexEntry> index_;
+  int64_t index_mtime_seconds_ = 0;
+
+  mutable std::mutex lock_;
+  std::unordered_map<std::string, IndexEntry> hashes_;
+};
+
+// With hierarchical configurations, clang-tidy uses the .clang-tidy file
+// closest to each file, which might inherit from the one closer to the
+// project root. Results of a file depend on all of these.
+class ConfigChain {
+ public:
+  // Hash of the configurations applying to the file; 0 if not using
+  // hierarchical configurations.
+  hash_t HashOf(const fs::path &file) {
+    return UseHierarchicalConfigs() ? HashOfDir(file.parent_path()) : 0;
+  }
+
+  // Forget what was read, as configurations might have changed.
+  void Clear() {
+    const std::lock_guard<std::mutex> lock(lock_);
+    dir_hashes_.clear();
+  }
+
+ private:
+  hash_t HashOfDir(const fs::path &dir) {
+    {
+      const std::lock_guard<std::mutex> lock(lock_);
+      const auto found = dir_hashes_.find(dir.string());
+      if (found != dir_hashes_.end()) {
+        return found->second;
+      }
+    }
+    const bool is_root = dir.empty() || dir == ".";
+    const fs::path config = dir / ".clang-tidy";
+    std::error_code ec;
+    hash_t result = 0;
+    if (fs::exists(config, ec)) {
+      const std::string content = GetContent(config);
+      result = hashContent(content);
+      if (!is_root && InheritsParentConfig(content)) {
+        result = result * 31 + HashOfDir(dir.parent_path());
+      }
+    } else if (!is_root) {
+      result = HashOfDir(dir.parent_path());
+    }
+    const std::lock_guard<std::mutex> lock(lock_);
+    dir_hashes_[dir.string()] = result;
+    return result;
+  }
+
+  static bool InheritsParentConfig(std::string_view content) {
+    bool result = false;
+    ForEachLine(content, [&](std::string_view line, bool) {
+      if (line.substr(0, 20) == "InheritParentConfig:") {
+        result = line.find("true") != std::string_view::npos;
+      }
+    });
+    return result;
+  }
+
+  std::mutex lock_;
+  std::unordered_map<std::string, hash_t> dir_hashes_;
+};
+
+// Observations from previous clang-tidy runs per file, such as how long it
+// took. Used to schedule the next run, e.g. start the longest running files
+// first so that they don't end up as stragglers keeping everyone waiting.
+class FileHistory {
+ public:
+  explicit FileHistory(const fs::path &history_file)
+      : history_file_(history_file) {
+    Load();
+  }
+
+  // Wall time in seconds clang-tidy took on the file the last time.
+  std::optional<double> Duration(const fs::path &file) const {
+    const std::lock_guard<std::mutex> lock(lock_);
+    const auto found = entries_.find(file.string());
+    if (found == entries_.end() || found->second.seconds < 0) {
+      return std::nullopt;
+    }
+    return found->second.seconds;
+  }
+
+  // Peak resident memory in KiB clang-tidy needed for the file last time.
+  std::optional<uint64_t> MaxRss(const fs::path &file) const {
+    const std::lock_guard<std::mutex> lock(lock_);
+    const auto found = entries_.find(file.string());
+    if (found == entries_.end() || found->second.max_rss_kb == 0) {
+      return std::nullopt;
+    }
+    return found->second.max_rss_kb;
+  }
+
+  // Did clang-tidy report anything for the file the last time ?
+  bool HadFindings(const fs::path &file) const {
+    const std::lock_guard<std::mutex> lock(lock_);
+    const auto found = entries_.find(file.string());
+    return found != entries_.end() && found->second.had_findings;
+  }
+
+  // Time the history was last saved, i.e. the end of the previous run.
+  std::optional<file_time> LastSaved() const { return last_saved_; }
+
+  void Record(const fs::path &file, double seconds, uint64_t max_rss_kb,
+              bool had_findings) {
+    const std::lock_guard<std::mutex> lock(lock_);
+    Entry &entry = entries_[file.string()];
+    entry.seconds = seconds;
+    entry.max_rss_kb = max_rss_kb;
+    entry.had_findings = had_findings;
+  }
+
+  void Save() const {
+    const std::string tmp_file =
+        history_file_.string() + "." + std::to_string(getpid()) + ".tmp";
+    FILE *out = fopen(tmp_file.c_str(), "wb");
+    if (!out) {
+      return;  // Best effort.
+    }
+    const std::lock_guard<std::mutex> lock(lock_);
+    for (const auto &[file, e] : entries_) {
+      fprintf(out, "%.3f %" PRIu64 " %d %s\n", e.seconds, e.max_rss_kb,
+              e.had_findings ? 1 : 0, file.c_str());
+    }
+    if (fclose(out) == 0) {
+      fs::rename(tmp_file, history_file_);  // atomic replacement
+    }
+  }
+
+ private:
+  struct Entry {
+    double seconds = -1;
+    uint64_t max_rss_kb = 0;
+    bool had_findings = false;
+  };
+
+  void Load() {
+    FILE *in = fopen(history_file_.string().c_str(), "rb");
+    if (!in) {
+      return;
+    }
+    std::error_code ec;
+    if (const file_time saved = fs::last_write_time(history_file_, ec);
+        !ec) {
+      last_saved_ = saved;
+    }
+    char line[4096];
+    while (fgets(line, sizeof(line), in)) {
+      Entry e;
+      int path_start = 0;
+      int findings = 0;
+      int findings_end = 0;
+      if (sscanf(line, "%lf %" SCNu64 " %n%d%n", &e.seconds, &e.max_rss_kb,
+                 &path_start, &findings, &findings_end) < 2 ||
+          path_start == 0) {
+        continue;
+      }
+      // Histories written by earlier versions have no findings column.
+      if (findings_end > 0 && line[findings_end] == ' ') {
+        e.had_findings = (findings != 0);
+        path_start = findings_end + 1;
+      }
+      std::string file(line + path_start);
+      if (!file.empty() && file.back() == '\n') {
+        file.pop_back();
+      }
+      entries_.emplace(std::move(file), e);
+    }
+    fclose(in);
+  }
+
+  const fs::path history_file_;
+  std::optional<file_time> last_saved_;
+  mutable std::mutex lock_;
+  std::unordered_map<std::string, Entry> entries_;
+};
+
+// Keep track of the headers a translation unit consumed during its last
+// clang-tidy run, so that the result is invalidated exactly when any of
+// these (transitively) included headers changes.
+//
+// The list of headers is stored next to the result as manifest keyed by
+// the hash of the file itself. The result is then stored with a key that
+// additionally incorporates the content of all the headers in that list.
+class DependencyTracker {
+ public:
+  DependencyTracker(ContentAddressedStore &store, ContentHasher &hasher)
+      : store_(store), hasher_(hasher) {}
+
+  // Return the key the result of the given file is stored under, considering
+  // the current content of all its headers. Returns an empty optional if
+  // we don't know the dependencies yet.
+  std::optional<filepath_contenthash_t> ResultKey(
+      const filepath_contenthash_t &file) const {
+    if (!kConfig.revisit_if_any_include_changes) {
+      return file;
+    }
+    const auto headers = Headers(file);
+    if (!headers) {
+      return std::nullopt;
+    }
+    return filepath_contenthash_t{file.first, CombinedHash(file, *headers)};
+  }
+
+  // Headers the file included in its last clang-tidy run, if known.
+  std::optional<std::vector<fs::path>> Headers(
+      const filepath_contenthash_t &file) const {
+    const auto manifest_content = store_.Lookup(file, kManifestSuffix);
+    if (!manifest_content) {
+      return std::nullopt;
+    }
+    std::vector<fs::path> headers;
+    ForEachLine(*manifest_content, [&](std::string_view line, bool) {
+      headers.emplace_back(line);
+    });
+    return headers;
+  }
+
+  // Remember the headers "file" depends on and return the key the result
+  // is to be stored under.
+  filepath_contenthash_t Record(const filepath_contenthash_t &file,
+                                const std::vector<fs::path> &headers) const {
+    if (!kConfig.revisit_if_any_include_changes) {
+      return file;
+    }
+    std::string manifest;
+    for (const fs::path &header : headers) {
+      manifest.append(header.string()).append("\n");
+    }
+    store_.Store(file, manifest, kManifestSuffix);
+    return {file.first, CombinedHash(file, headers)};
+  }
+
+ private:
+  static constexpr std::string_view kManifestSuffix = ".deps";
+
+  hash_t CombinedHash(const filepath_contenthash_t &file,
+                      const std::vector<fs::path> &headers) const {
+    hash_t result = file.second;
+    for (const fs::path &header : headers) {
+      result ^= hashContent(header.string() + ":" +
+                            ToHex(hasher_.HashOf(header)));
+    }
+    return result;
+  }
+
+  ContentAddressedStore &store_;
+  ContentHasher &hasher_;
+};
+
+// Just enough of a JSON parser to read a compilation database.
+class JsonScanner {
+ public:
+  explicit JsonScanner(std::string_view json) : json_(json) {}
+
+  // Skip whitespace; if next character is "c", consume it and return true.
+  bool Consume(char c) {
+    while (pos_ < json_.size() && isspace(json_[pos_])) {
+      ++pos_;
+    }
+    if (pos_ < json_.size() && json_[pos_] == c) {
+      ++pos_;
+      return true;
+    }
+    return false;
+  }
+
+  bool ok() const { return ok_; }
+
+  // Read string at current position. Unicode escapes are not decoded, which
+  // is fine for our purpose of creating a fingerprint.
+  std::string String() {
+    std::string result;
+    if (!Consume('"')) {
+      ok_ = false;
+      return result;
+    }
+    while (pos_ < json_.size() && json_[pos_] != '"') {
+      char c = json_[pos_++];
+      if (c == '\\' && pos_ < json_.size()) {
+        c = json_[pos_++];
+        switch (c) {
+          case 'n': c = '\n'; break;
+          case 't': c = '\t'; break;
+          case 'r': c = '\r'; break;
+          case 'b': c = '\b'; break;
+          case 'f': c = '\f'; break;
+          case 'u': result.push_back('\\'); break;
+          default: break;  // Includes quote, backslash and slash.
+        }
+      }
+      result.push_back(c);
+    }
+    ok_ &= Consume('"');
+    return result;
+  }
+
+  // Skip over any value we're not interested in.
+  void SkipValue() {
+    if (Consume('"')) {
+      --pos_;
+      String();
+      return;
+    }
+    if (Consume('[') || Consume('{')) {
+      int depth = 1;
+      while (ok_ && depth > 0 && pos_ < json_.size()) {
+        const char c = json_[pos_];
+        if (c == '"') {
+          String();
+          continue;
+        }
+        depth += (c == '[' || c == '{') ? 1 : (c == ']' || c == '}') ? -1 : 0;
+        ++pos_;
+      }
+      ok_ &= (depth == 0);
+      return;
+    }
+    // Number, true, false, null.
+    while (pos_ < json_.size() && json_[pos_] != ',' && json_[pos_] != ']' &&
+           json_[pos_] != '}') {
+      ++pos_;
+    }
+  }
+
+ private:
+  const std::string_view json_;
+  size_t pos_ = 0;
+  bool ok_ = true;
+};
+
+// Split a command line the way a POSIX shell would: by whitespace, but
+// honoring quotes and backslash escapes.
+std::vector<std::string> SplitCommandLine(std::string_view command) {
+  std::vector<std::string> result;
+  std::string current;
+  bool in_word = false;
+  char quote = 0;
+  for (size_t i = 0; i < command.size(); ++i) {
+    const char c = command[i];
+    if (quote) {
+      if (c == quote) {
+        quote = 0;
+      } else if (c == '\\' && quote == '"' && i + 1 < command.size()) {
+        current.push_back(command[++i]);
+      } else {
+        current.push_back(c);
+      }
+    } else if (c == '\'' || c == '"') {
+      quote = c;
+      in_word = true;
+    } else if (c == '\\' && i + 1 < command.size()) {
+      current.push_back(command[++i]);
+      in_word = true;
+    } else if (isspace(c)) {
+      if (in_word) {
+        result.push_back(std::move(current));
+        current.clear();
+        in_word = false;
+      }
+    } else {
+      current.push_back(c);
+      in_word = true;
+    }
+  }
+  if (in_word) {
+    result.push_back(std::move(current));
+  }
+  return result;
+}
+
+// Fingerprints of the compile command of each file in the compilation
+// database (flags, defines, include paths, ...), so that a regenerated
+// database only results in revisiting the files whose command changed.
+class CompilationDatabase {
+ public:
+  // Load compile_commands.json or compile_flags.txt, whichever is available.
+  // Returns false if neither exists.
+  bool Load() {
+    std::error_code ec;
+    if (fs::exists("compile_commands.json", ec)) {
+      const std::string json = GetContent(fs::path("compile_commands.json"));
+      if (!ParseCompileCommands(json)) {
+        std::cerr << "Could not parse compile_commands.json; any change in it "
+                  << "will revisit all files.\n";
+        fingerprints_.clear();
+        default_fingerprint_ = hashContent(json);
+      }
+      return true;
+    }
+    if (fs::exists("compile_flags.txt", ec)) {
+      // Same flags for everything.
+      default_fingerprint_ =
+          hashContent(GetContent(fs::path("compile_flags.txt")));
+      return true;
+    }
+    return false;
+  }
+
+  // If the file is in the compilation database.
+  bool Contains(const fs::path &file) const {
+    return commands_.count(file.string()) > 0;
+  }
+
+  // Fingerprint of the compile command for given file. Files not mentioned
+  // in the compilation database (such as headers) get a default fingerprint:
+  // clang-tidy interpolates their flags from the commands of other files, so
+  // it covers all distinct commands.
+  hash_t FingerprintOf(const fs::path &file) const {
+    const auto found = fingerprints_.find(file.string());
+    return found == fingerprints_.end() ? default_fingerprint_ : found->second;
+  }
+
+  struct Command {
+    std::string directory;
+    std::vector<std::string> args;  // Without file to compile and outputs.
+  };
+
+  // Compile command of the file; nullptr if not in the compilation database
+  // or compiled with multiple commands.
+  const Command *CommandOf(const fs::path &file) const {
+    const auto found = commands_.find(file.string());
+    return found == commands_.end() || found->second.args.empty()
+               ? nullptr
+               : &found->second;
+  }
+
+  // Directory the file is compiled in; empty if not in the compilation
+  // database.
+  fs::path DirectoryOf(const fs::path &file) const {
+    const auto found = commands_.find(file.string());
+    return found == commands_.end() ? fs::path{}
+                                    : fs::path(found->second.directory);
+  }
+
+ private:
+  bool ParseCompileCommands(std::string_view json) {
+    const std::string project_prefix = fs::current_path().string() + "/";
+    JsonScanner scanner(json);
+    if (!scanner.Consume('[')) {
+      return false;
+    }
+    std::set<hash_t> distinct_commands;
+    while (scanner.ok() && !scanner.Consume(']')) {
+      if (!scanner.Consume('{')) {
+        return false;
+      }
+      std::string directory;
+      std::string file;
+      std::string output;
+      std::vector<std::string> args;
+      while (scanner.ok() && !scanner.Consume('}')) {
+        const std::string key = scanner.String();
+        if (!scanner.Consume(':')) {
+          return false;
+        }
+        if (key == "directory") {
+          directory = scanner.String();
+        } else if (key == "file") {
+          file = scanner.String();
+        } else if (key == "output") {
+          output = scanner.String();
+        } else if (key == "command") {
+          args = SplitCommandLine(scanner.String());
+        } else if (key == "arguments" && scanner.Consume('[')) {
+          while (scanner.ok() && !scanner.Consume(']')) {
+            args.push_back(scanner.String());
+            scanner.Consume(',');
+          }
+        } else {
+          scanner.SkipValue();
+        }
+        scanner.Consume(',');
+      }
+      scanner.Consume(',');
+
+      fs::path file_path = fs::path(directory) / file;  // Noop if absolute.
+      std::string key = file_path.lexically_normal().string();
+      if (key.rfind(project_prefix, 0) == 0) {
+        key = key.substr(project_prefix.size());
+      }
+      // A file compiled multiple times is processed by clang-tidy for each
+      // of the commands, so all of them contribute. The location of the
+      // project does not, so that checkouts in different places can share
+      // a cache.
+      std::vector<std::string> flags = NormalizedFlags(args, file);
+      std::string flat_command = directory + '\0';
+      for (const std::string &flag : flags) {
+        flat_command.append(flag).append(1, '\0');
+      }
+      const hash_t command_hash =
+          hashContent(WithoutProjectRoot(flat_command, project_prefix));
+      hash_t &fingerprint = fingerprints_[key];
+      fingerprint = fingerprint * 31 + command_hash;
+      distinct_commands.insert(command_hash);
+      auto [command, inserted] =
+          commands_.emplace(key, Command{directory, std::move(flags)});
+      if (!inserted) {
+        command->second.args.clear();  // Multiple commands.
+      }
+    }
+    // Files using flags already seen don't change what is interpolated.
+    for (const hash_t command_hash : distinct_commands) {
+      default_fingerprint_ = default_fingerprint_ * 31 + command_hash;
+    }
+    return scanner.ok();
+  }
+
+  // Flags relevant for the outcome of a clang-tidy run, i.e. without the
+  // file to compile and the outputs.
+  static std::vector<std::string> NormalizedFlags(
+      const std::vector<std::string> &args, std::string_view file) {
+    std::vector<std::string> result;
+    for (size_t i = 0; i < args.size(); ++i) {
+      const std::string &arg = args[i];
+      if (arg == file || arg == "-c") {
+        continue;
+      }
+      if (IsOneOf(arg, {"-o", "-MF", "-MT", "-MQ"})) {
+        ++i;  // Also skip the parameter.
+        continue;
+      }
+      if (arg.rfind("-o", 0) == 0) {
+        continue;
+      }
+      result.push_back(arg);
+    }
+    return result;
+  }
+
+  // Replace all occurrences of the project root (given with trailing slash)
+  // with a placeholder.
+  static std::string WithoutProjectRoot(std::string_view in,
+                                        std::string_view project_prefix) {
+    const std::string_view root =
+        project_prefix.substr(0, project_prefix.size() - 1);
+    std::string result;
+    size_t pos;
+    while (!root.empty() && (pos = in.find(root)) != std::string_view::npos) {
+      result.append(in.substr(0, pos)).append("<root>");
+      in.remove_prefix(pos + root.size());
+    }
+    return result.append(in);
+  }
+
+  hash_t default_fingerprint_ = 0;
+  std::unordered_map<std::string, hash_t> fingerprints_;
+  std::unordered_map<std::string, Command> commands_;
+};
+
+// Scanners for clang-tidy output. Every output goes through these and they
+// can be megabytes (e.g. misc-include-cleaner on a large file), so these are
+// simple linear scans on string_views instead of std::regex.
+
+// Returns the "[check-name]" at the end of a line, or an empty view if the
+// line does not end in one. Check names have at least one dash in them.
+std::string_view TrailingCheckName(std::string_view line) {
+  if (line.empty() || line.back() != ']') {
+    return {};
+  }
+  const size_t open = line.find_last_of('[');
+  if (open == std::string_view::npos) {
+    return {};
+  }
+  const std::string_view name = line.substr(open + 1, line.size() - open - 2);
+  const size_t dash = name.find('-');
+  if (dash == 0 || dash == std::string_view::npos || dash + 1 == name.size()) {
+    return {};
+  }
+  for (const char c : name) {
+    if (!isalpha(static_cast<unsigned char>(c)) && c != '.' && c != '-') {
+      return {};
+    }
+  }
+  return line.substr(open);
+}
+
+// If pos points to ":<line>:<column>:", return the position after it,
+// otherwise npos.
+size_t SkipLineColumn(std::string_view s, size_t pos) {
+  for (int i = 0; i < 2; ++i) {
+    if (pos >= s.size() || s[pos] != ':') {
+      return std::string_view::npos;
+    }
+    const size_t digits_end = s.find_first_not_of("0123456789", pos + 1);
+    if (digits_end == pos + 1 || digits_end == std::string_view::npos) {
+      return std::string_view::npos;
+    }
+    pos = digits_end;
+  }
+  return (s[pos] == ':') ? pos + 1 : std::string_view::npos;
+}
+
+// Given a finding line such as
+//   "some/path/foo.cc:42:7: warning: message [check-name]"
+// return the basename of the file ("foo.cc"), or an empty view if this is
+// not a finding line.
+std::string_view FindingFileBasename(std::string_view line) {
+  const std::string_view check = TrailingCheckName(line);
+  if (check.empty()) {
+    return {};
+  }
+  const std::string_view head = line.substr(0, line.size() - check.size());
+  // Carriage returns are only tolerated within the filename.
+  const size_t first_cr = head.find('\r');
+  const size_t last_cr = head.rfind('\r');
+
+  // Basename candidates start after a slash; the message might contain
+  // slashes as well, so the rightmost one with :line:column: wins.
+  size_t segment_end = head.size();
+  for (;;) {
+    const size_t slash =
+        segment_end == 0 ? std::string_view::npos
+                         : head.rfind('/', segment_end - 1);
+    const size_t start = (slash == std::string_view::npos) ? 0 : slash + 1;
+    if (first_cr == std::string_view::npos || first_cr + 1 >= start) {
+      for (size_t colon = segment_end; colon-- > start + 1;) {
+        if (head[colon] != ':') {
+          continue;
+        }
+        const size_t message = SkipLineColumn(head, colon);
+        if (message != std::string_view::npos &&
+            (last_cr == std::string_view::npos || last_cr < message)) {
+          return head.substr(start, colon - start);
+        }
+      }
+    }
+    if (slash == std::string_view::npos) {
+      return {};
+    }
+    segment_end = slash;
+  }
+}
+
+// Filter clang-tidy output and append to "out" only lines that are reported
+// for the 'interesting_file' basename. Clang-tidy tends to also report
+// warnings for some included files, but we're not interested in them.
+void FilterCheckLines(std::string_view interesting_file, std::string_view in,
+                      std::string *out) {
+  // Simple 'awk' - go through each line and output depending on state.
+  bool do_print_line = true;
+  ForEachLine(in, [&](std::string_view line, bool) {
+    const std::string_view file = FindingFileBasename(line);
+    if (!file.empty()) {
+      do_print_line = (file == interesting_file);
+    }
+    if (do_print_line) {
+      out->append(line).append(1, '\n');
+    }
+  });
+}
+
+// Counterpart of FilterCheckLines(): append to "out" only lines that are
+// reported for files other than the given basenames, such as headers.
+void FilterOtherFilesCheckLines(
+    const std::unordered_set<std::string> &basenames, std::string_view in,
+    std::string *out) {
+  bool do_print_line = false;
+  ForEachLine(in, [&](std::string_view line, bool) {
+    const std::string_view file = FindingFileBasename(line);
+    if (!file.empty()) {
+      do_print_line = basenames.count(std::string(file)) == 0;
+    }
+    if (do_print_line) {
+      out->append(line).append(1, '\n');
+    }
+  });
+}
+
+// Count findings per check of the output of one file; lines reported
+// multiple times are counted once.
+std::map<std::string, int> CountChecks(std::string_view tidy) {
+  std::map<std::string, int> checks;
+  std::unordered_set<std::string_view> line_already_seen;  // de-dup
+  ForEachLine(tidy, [&](std::string_view line, bool has_newline) {
+    const std::string_view check = TrailingCheckName(line);
+    if (check.empty() || !has_newline ||
+        line.find('\r') != std::string_view::npos) {
+      return;
+    }
+    if (line_already_seen.insert(line).second) {
+      checks[std::string(check)]++;
+    }
+  });
+  return checks;
+}
+
+// Remove path prefixes at the start of lines (and a "./" after it) that
+// clang-tidy emits instead of a path relative to the project root.
+std::string RemovePathPrefixes(std::string_view in,
+                               const std::vector<std::string> &prefixes) {
+  std::string result;
+  result.reserve(in.size());
+  ForEachLine(in, [&](std::string_view line, bool has_newline) {
+    for (const std::string &prefix : prefixes) {
+      if (line.substr(0, prefix.size()) == prefix) {
+        line.remove_prefix(prefix.size());
+        break;
+      }
+    }
+    if (line.substr(0, 2) == "./") {
+      line.remove_prefix(2);
+    }
+    result.append(line);
+    if (has_newline) {
+      result.append(1, '\n');
+    }
+  });
+  return result;
+}
+
+// Derive the output of a clang-tidy run with only a subset of the checks
+// from the output of a run with all of them: findings of checks that are
+// not enabled are dropped, together with their notes and source excerpts.
+class CheckSubsetFilter {
+ public:
+  // Create a filter for a run with the additional "--checks=" globs, given
+  // the checks enabled with and without them. Returns an empty optional if
+  // the globs enable anything not enabled without them.
+  static std::optional<CheckSubsetFilter> Create(
+      std::string_view globs, const std::vector<std::string> &enabled,
+      const std::vector<std::string> &enabled_without_globs) {
+    if (enabled.empty() || enabled_without_globs.empty()) {
+      return std::nullopt;  // Could not determine.
+    }
+    const std::unordered_set<std::string> all(enabled_without_globs.begin(),
+                                              enabled_without_globs.end());
+    for (const std::string &check : enabled) {
+      if (!all.count(check)) {
+        return std::nullopt;
+      }
+    }
+    // Compiler diagnostics are not listed as checks; we don't know if they
+    // were enabled without the globs.
+    constexpr std::string_view kDiagnostic = "clang-diagnostic-";
+    for (const Glob &glob : ParseGlobs(globs)) {
+      const std::string_view literal =
+          std::string_view(glob.pattern).substr(0, glob.pattern.find('*'));
+      if (glob.positive && (kDiagnostic.substr(0, literal.size()) == literal ||
+                            literal.substr(0, kDiagnostic.size()) ==
+                                kDiagnostic)) {
+        return std::nullopt;
+      }
+    }
+    return CheckSubsetFilter(globs, enabled, /*keep_errors=*/true);
+  }
+
+  // Filter only keeping findings of the given checks. Compiler diagnostics
+  // are kept only if "keep_diagnostics" is set.
+  static CheckSubsetFilter ForChecks(const std::vector<std::string> &enabled,
+                                     bool keep_diagnostics) {
+    return CheckSubsetFilter(keep_diagnostics ? "" : "-*", enabled,
+                             keep_diagnostics);
+  }
+
+  std::string Apply(std::string_view output) const {
+    std::string result;
+    bool keep = true;
+    ForEachLine(output, [&](std::string_view line, bool has_newline) {
+      std::vector<std::string_view> names;
+      const size_t names_start = FindingCheckNames(line, &names);
+      if (names_start != std::string_view::npos) {
+        std::string kept_names;
+        bool any_check = false;
+        for (const std::string_view name : names) {
+          if (name == "-warnings-as-errors" || IsEnabled(name)) {
+            kept_names.append(kept_names.empty() ? "" : ",").append(name);
+            any_check |= (name != "-warnings-as-errors");
+          }
+        }
+        keep = any_check;
+        if (keep) {
+          result.append(line.substr(0, names_start))
+              .append(kept_names)
+              .append("]");
+          if (has_newline) {
+            result.append(1, '\n');
+          }
+        }
+        return;
+      }
+      if (keep) {
+        result.append(line);
+        if (has_newline) {
+          result.append(1, '\n');
+        }
+      }
+    });
+    return result;
+  }
+
+ private:
+  struct Glob {
+    bool positive;
+    std::string pattern;
+  };
+
+  CheckSubsetFilter(std::string_view globs,
+                    const std::vector<std::string> &enabled, bool keep_errors)
+      : globs_(ParseGlobs(globs)),
+        enabled_(enabled.begin(), enabled.end()),
+        keep_errors_(keep_errors) {}
+
+  // Check globs as clang-tidy understands them: comma separated, a leading
+  // dash disables, the last matching glob decides.
+  static std::vector<Glob> ParseGlobs(std::string_view globs) {
+    std::vector<Glob> result;
+    while (!globs.empty()) {
+      const size_t end = globs.find_first_of(",\n");
+      std::string_view glob = globs.substr(0, end);
+      globs.remove_prefix(end == std::string_view::npos ? globs.size()
+                                                        : end + 1);
+      while (!glob.empty() && isspace(glob.front())) {
+        glob.remove_prefix(1);
+      }
+      while (!glob.empty() && isspace(glob.back())) {
+        glob.remove_suffix(1);
+      }
+      const bool positive = glob.substr(0, 1) != "-";
+      if (!positive) {
+        glob.remove_prefix(1);
+      }
+      if (!glob.empty()) {
+        result.push_back({positive, std::string(glob)});
+      }
+    }
+    return result;
+  }
+
+  static bool GlobMatch(std::string_view pattern, std::string_view name) {
+    const size_t star = pattern.find('*');
+    if (star == std::string_view::npos) {
+      return pattern == name;
+    }
+    if (name.substr(0, star) != pattern.substr(0, star)) {
+      return false;
+    }
+    pattern.remove_prefix(star + 1);
+    name.remove_prefix(star);
+    for (size_t i = 0; i <= name.size(); ++i) {
+      if (GlobMatch(pattern, name.substr(i))) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  bool IsEnabled(std::string_view name) const {
+    if (name.substr(0, 17) != "clang-diagnostic-") {
+      return enabled_.count(std::string(name)) > 0;
+    }
+    if (name == "clang-diagnostic-error") {
+      return keep_errors_;  // Always reported.
+    }
+    // It was reported, so it is enabled unless the globs disable it.
+    for (auto it = globs_.rbegin(); it != globs_.rend(); ++it) {
+      if (GlobMatch(it->pattern, name)) {
+        return it->positive;
+      }
+    }
+    return true;
+  }
+
+  // If this is a line with a warning or error, fill the check names in the
+  // trailing "[name,...]" and return the position of the first.
+  static size_t FindingCheckNames(std::string_view line,
+                                  std::vector<std::string_view> *names) {
+    if (line.empty() || line.back() != ']' ||
+        (line.find(": warning: ") == std::string_view::npos &&
+         line.find(": error: ") == std::string_view::npos)) {
+      return std::string_view::npos;
+    }
+    const size_t open = line.find_last_of('[');
+    if (open == std::string_view::npos) {
+      return std::string_view::npos;
+    }
+    std::string_view list = line.substr(open + 1, line.size() - open - 2);
+    while (!list.empty()) {
+      const size_t comma = list.find(',');
+      const std::string_view name = list.substr(0, comma);
+      const std::string bracketed = "[" + std::string(name) + "]";
+      if (name != "-warnings-as-errors" &&
+          TrailingCheckName(bracketed).empty()) {
+        return std::string_view::npos;
+      }
+      names->push_back(name);
+      list.remove_prefix(comma == std::string_view::npos ? list.size()
+                                                         : comma + 1);
+    }
+    return names->empty() ? std::string_view::npos : open + 1;
+  }
+
+  std::vector<Glob> globs_;
+  std::unordered_set<std::string> enabled_;
+  bool keep_errors_;
+};
+
+// Line and column of a line with a warning or error; empty optional if it
+// is not one.
+std::optional<std::pair<uint64_t, uint64_t>> FindingLocation(
+    std::string_view line) {
+  size_t severity = line.find(": warning: ");
+  if (severity == std::string_view::npos) {
+    severity = line.find(": error: ");
+  }
+  if (severity == std::string_view::npos || line.back() != ']') {
+    return std::nullopt;
+  }
+  const size_t column_start = line.rfind(':', severity - 1);
+  if (column_start == std::string_view::npos || column_start == 0) {
+    return std::nullopt;
+  }
+  const size_t line_start = line.rfind(':', column_start - 1);
+  if (line_start == std::string_view::npos ||
+      SkipLineColumn(line, line_start) != severity + 1) {
+    return std::nullopt;
+  }
+  return std::make_pair(strtoull(line.data() + line_start + 1, nullptr, 10),
+                        strtoull(line.data() + column_start + 1, nullptr, 10));
+}
+
+// Merge the outputs of two clang-tidy runs with different checks on the
+// same file in order of location, as a run with all checks reports them.
+std::string MergeFindings(std::string_view a, std::string_view b) {
+  // A finding with its notes and source excerpts.
+  struct Block {
+    std::pair<uint64_t, uint64_t> location;
+    std::string_view text;
+  };
+  auto split = [](std::string_view output) {
+    std::vector<Block> result;
+    ForEachLine(output, [&](std::string_view line, bool has_newline) {
+      const auto location = FindingLocation(line);
+      if (location || result.empty()) {
+        result.push_back({location.value_or(std::make_pair(0, 0)), line});
+      }
+      const char *end = line.data() + line.size() + (has_newline ? 1 : 0);
+      result.back().text = {result.back().text.data(),
+                            size_t(end - result.back().text.data())};
+    });
+    return result;
+  };
+  const std::vector<Block> a_blocks = split(a);
+  const std::vector<Block> b_blocks = split(b);
+  std::vector<Block> merged;
+  std::merge(a_blocks.begin(), a_blocks.end(), b_blocks.begin(),
+             b_blocks.end(), std::back_inserter(merged),
+             [](const Block &x, const Block &y) {
+               return x.location < y.location;
+             });
+  std::string result;
+  for (const Block &block : merged) {
+    result.append(block.text);
+    if (!result.empty() && result.back() != '\n') {
+      result.append(1, '\n');
+    }
+  }
+  return result;
+}
+
+// A replacement clang-tidy suggests to fix a finding.
+struct Replacement {
+  fs::path file;
+  uint64_t offset = 0;
+  uint64_t length = 0;
+  std::string text;
+  hash_t file_hash = 0;  // Content the offsets refer to.
+
+  bool operator==(const Replacement &other) const {
+    return file == other.file && offset == other.offset &&
+           length == other.length && text == other.text;
+  }
+};
+
+// The replacements of one finding. They are applied all or nothing.
+struct Fix {
+  bool from_note = false;  // Only applied with --fix-notes.
+  std::vector<Replacement> replacements;
+};
+
+// Append unicode code point "c" UTF-8 encoded.
+void AppendUtf8(uint32_t c, std::string *out) {
+  if (c < 0x80) {
+    out->push_back(c);
+  } else if (c < 0x800) {
+    out->push_back(0xc0 | (c >> 6));
+    out->push_back(0x80 | (c & 0x3f));
+  } else if (c < 0x10000) {
+    out->push_back(0xe0 | (c >> 12));
+    out->push_back(0x80 | ((c >> 6) & 0x3f));
+    out->push_back(0x80 | (c & 0x3f));
+  } else {
+    out->push_back(0xf0 | (c >> 18));
+    out->push_back(0x80 | ((c >> 12) & 0x3f));
+    out->push_back(0x80 | ((c >> 6) & 0x3f));
+    out->push_back(0x80 | (c & 0x3f));
+  }
+}
+
+// If "value" starts a single or double quoted YAML scalar that is not
+// closed on the same line.
+bool IsOpenYamlScalar(std::string_view value) {
+  if (value.empty() || (value.front() != '\'' && value.front() != '"')) {
+    return false;
+  }
+  const char quote = value.front();
+  for (size_t i = 1; i < value.size(); ++i) {
+    if (quote == '"' && value[i] == '\\') {
+      ++i;
+    } else if (value[i] == quote) {
+      if (quote == '\'' && i + 1 < value.size() && value[i + 1] == '\'') {
+        ++i;  // Escaped single quote.
+        continue;
+      }
+      return false;
+    }
+  }
+  return true;
+}
+
+// Fold the line breaks of a quoted YAML scalar spanning multiple lines: a
+// single line break becomes a space, otherwise each empty line stands for
+// a newline. Whitespace around line breaks is dropped. In double quoted
+// scalars, an escaped line break joins the lines.
+std::string FoldYamlLines(std::string_view in, bool double_quoted) {
+  std::string result;
+  size_t empty_lines = 0;
+  bool first = true;
+  bool joined = false;
+  ForEachLine(in, [&](std::string_view line, bool has_newline) {
+    if (!first) {
+      while (!line.empty() && (line.front() == ' ' || line.front() == '\t')) {
+        line.remove_prefix(1);
+      }
+    }
+    if (has_newline) {
+      while (!line.empty() && (line.back() == ' ' || line.back() == '\t')) {
+        line.remove_suffix(1);
+      }
+    }
+    if (!first && line.empty() && has_newline) {
+      ++empty_lines;
+      return;
+    }
+    if (!first) {
+      if (empty_lines > 0) {
+        result.append(empty_lines, '\n');
+      } else if (!joined) {
+        result.push_back(' ');
+      }
+    }
+    empty_lines = 0;
+    first = false;
+    size_t backslashes = 0;
+    while (backslashes < line.size() &&
+           line[line.size() - 1 - backslashes] == '\\') {
+      ++backslashes;
+    }
+    joined = double_quoted && has_newline && backslashes % 2 == 1;
+    if (joined) {
+      line.remove_suffix(1);
+    }
+    result.append(line);
+  });
+  return result;
+}
+
+// Value of a YAML scalar as written by LLVM: plain, single quoted, or
+// double quoted with escapes. Quoted scalars might span multiple lines.
+std::string YamlScalar(std::string_view value) {
+  std::string folded;
+  if (value.size() >= 2 && value.find('\n') != std::string_view::npos &&
+      (value.front() == '\'' || value.front() == '"') &&
+      value.back() == value.front()) {
+    folded = value.front();
+    folded.append(FoldYamlLines(value.substr(1, value.size() - 2),
+                                value.front() == '"'));
+    folded.push_back(value.back());
+    value = folded;
+  }
+  if (value.size() >= 2 && value.front() == '\'' && value.back() == '\'') {
+    std::string result;
+    for (size_t i = 1; i + 1 < value.size(); ++i) {
+      result.push_back(value[i]);
+      if (value[i] == '\'' && value[i + 1] == '\'') {
+        ++i;
+      }
+    }
+    return result;
+  }
+  if (value.size() < 2 || value.front() != '"' || value.back() != '"') {
+    return std::string(value);
+  }
+  value = value.substr(1, value.size() - 2);
+  std::string result;
+  for (size_t i = 0; i < value.size(); ++i) {
+    if (value[i] != '\\' || i + 1 == value.size()) {
+      result.push_back(value[i]);
+      continue;
+    }
+    const char escaped = value[++i];
+    int hex_digits = 0;
+    switch (escaped) {
+      case '0': result.push_back('\0'); break;
+      case 'a': result.push_back('\a'); break;
+      case 'b': result.push_back('\b'); break;
+      case 't': result.push_back('\t'); break;
+      case 'n': result.push_back('\n'); break;
+      case 'v': result.push_back('\v'); break;
+      case 'f': result.push_back('\f'); break;
+      case 'r': result.push_back('\r'); break;
+      case 'e': result.push_back('\x1b'); break;
+      case 'N': AppendUtf8(0x85, &result); break;
+      case '_': AppendUtf8(0xa0, &result); break;
+      case 'L': AppendUtf8(0x2028, &result); break;
+      case 'P': AppendUtf8(0x2029, &result); break;
+      case 'x': hex_digits = 2; break;
+      case 'u': hex_digits = 4; break;
+      case 'U': hex_digits = 8; break;
+      default: result.push_back(escaped); break;  // Such as \\ or \"
+    }
+    if (hex_digits > 0) {
+      const std::string digits(value.substr(i + 1, hex_digits));
+      AppendUtf8(strtoul(digits.c_str(), nullptr, 16), &result);
+      i += digits.size();
+    }
+  }
+  return result;
+}
+
+// Parse the fixes clang-tidy writes with --export-fixes. Like --fix, only
+// the replacements of the findings themselves are considered; with
+// --fix-notes, a finding without them uses those of its note if there is
+// exactly one with replacements. Relative paths are resolved against the
+// build directory.
+std::vector<Fix> ParseExportedFixes(std::string_view yaml) {
+  std::vector<Fix> result;
+  struct Diagnostic {
+    std::vector<Replacement> replacements;
+    std::vector<std::vector<Replacement>> note_replacements;
+    std::string build_directory;
+  };
+  std::optional<Diagnostic> diagnostic;
+  auto finish_diagnostic = [&]() {
+    if (!diagnostic) {
+      return;
+    }
+    Fix fix;
+    if (!diagnostic->replacements.empty()) {
+      fix.replacements = std::move(diagnostic->replacements);
+    } else if (diagnostic->note_replacements.size() == 1) {
+      fix.from_note = true;
+      fix.replacements = std::move(diagnostic->note_replacements.front());
+    }
+    for (Replacement &replacement : fix.replacements) {
+      if (replacement.file.is_relative()) {
+        replacement.file = diagnostic->build_directory / replacement.file;
+      }
+    }
+    if (!fix.replacements.empty()) {
+      result.push_back(std::move(fix));
+    }
+    diagnostic.reset();
+  };
+  bool in_notes = false;
+  bool in_replacements = false;
+  std::vector<Replacement> *replacements = nullptr;
+  std::string continued;  // Line with a quoted scalar that is not closed yet.
+  ForEachLine(yaml, [&](std::string_view line, bool) {
+    std::string joined;
+    if (!continued.empty()) {
+      continued.append(1, '\n').append(line);
+      const std::string_view quoted =
+          std::string_view(continued).substr(continued.find(':') + 1);
+      if (IsOpenYamlScalar(quoted.substr(
+              std::min(quoted.find_first_not_of(' '), quoted.size())))) {
+        return;
+      }
+      joined = std::move(continued);
+      continued.clear();
+      line = joined;
+    }
+    const std::string_view full_line = line;
+    while (!line.empty() && line.front() == ' ') {
+      line.remove_prefix(1);
+    }
+    const bool list_item = line.substr(0, 2) == "- ";
+    if (list_item) {
+      line.remove_prefix(2);
+    }
+    const size_t colon = line.find(':');
+    if (colon == std::string_view::npos) {
+      return;
+    }
+    const std::string_view key = line.substr(0, colon);
+    std::string_view value = line.substr(colon + 1);
+    while (!value.empty() && value.front() == ' ') {
+      value.remove_prefix(1);
+    }
+    if (IsOpenYamlScalar(value)) {
+      continued = full_line;
+      return;
+    }
+    if (key == "Replacements" || key == "Ranges") {
+      in_replacements = key == "Replacements";
+    } else if (in_replacements && replacements &&
+               (key == "FilePath" || key == "Offset" || key == "Length" ||
+                key == "ReplacementText")) {
+      if (list_item && key == "FilePath") {
+        replacements->emplace_back().file = YamlScalar(value);
+      } else if (replacements->empty()) {
+        return;
+      } else if (key == "Offset") {
+        replacements->back().offset = strtoull(value.data(), nullptr, 10);
+      } else if (key == "Length") {
+        replacements->back().length = strtoull(value.data(), nullptr, 10);
+      } else if (key == "ReplacementText") {
+        replacements->back().text = YamlScalar(value);
+      }
+    } else {
+      in_replacements = false;
+      if (key == "DiagnosticName" && list_item) {
+        finish_diagnostic();
+        diagnostic.emplace();
+        in_notes = false;
+        replacements = &diagnostic->replacements;
+      } else if (!diagnostic) {
+        return;
+      } else if (key == "DiagnosticMessage") {
+        in_notes = false;
+        replacements = &diagnostic->replacements;
+      } else if (key == "Notes") {
+        in_notes = true;
+        replacements = nullptr;
+      } else if (key == "Message" && list_item && in_notes) {
+        replacements = &diagnostic->note_replacements.emplace_back();
+      } else if (key == "BuildDirectory") {
+        diagnostic->build_directory = YamlScalar(value);
+      }
+    }
+  });
+  finish_diagnostic();
+  return result;
+}
+
+// Fixes in the form they are cached: per fix a line
+//   <"fix"|"note-fix"> <#replacements>
+// followed by a line per replacement
+//   <offset> <length> <text-size> <file-hash> <path>
+// and the replacement text.
+std::string SerializeFixes(const std::vector<Fix> &fixes) {
+  std::string result;
+  for (const Fix &fix : fixes) {
+    result.append(fix.from_note ? "note-fix " : "fix ")
+        .append(std::to_string(fix.replacements.size()))
+        .append("\n");
+    for (const Replacement &r : fix.replacements) {
+      result.append(std::to_string(r.offset))
+          .append(" ")
+          .append(std::to_string(r.length))
+          .append(" ")
+          .append(std::to_string(r.text.size()))
+          .append(" ")
+          .append(ToHex(r.file_hash))
+          .append(" ")
+          .append(r.file.string())
+          .append("\n")
+          .append(r.text);
+    }
+  }
+  return result;
+}
+
+// Inverse of SerializeFixes(). Returns empty optional if malformed.
+std::optional<std::vector<Fix>> DeserializeFixes(std::string_view in) {
+  std::vector<Fix> result;
+  auto next_line = [&]() {
+    const size_t eol = std::min(in.find('\n'), in.size());
+    const std::string line(in.substr(0, eol));
+    in.remove_prefix(std::min(eol + 1, in.size()));
+    return line;
+  };
+  while (!in.empty()) {
+    const std::string fix_line = next_line();
+    Fix &fix = result.emplace_back();
+    size_t count;
+    char kind[16];
+    if (sscanf(fix_line.c_str(), "%15s %zu", kind, &count) != 2) {
+      return std::nullopt;
+    }
+    fix.from_note = std::string_view(kind) == "note-fix";
+    for (size_t i = 0; i < count; ++i) {
+      const std::string line = next_line();
+      Replacement &r = fix.replacements.emplace_back();
+      size_t text_size;
+      int path_start = 0;
+      if (sscanf(line.c_str(), "%" SCNu64 " %" SCNu64 " %zu %" SCNx64 " %n",
+                 &r.offset, &r.length, &text_size, &r.file_hash,
+                 &path_start) != 4 ||
+          path_start == 0 || text_size > in.size()) {
+        return std::nullopt;
+      }
+      r.file = line.substr(path_start);
+      r.text = in.substr(0, text_size);
+      in.remove_prefix(text_size);
+    }
+  }
+  return result;
+}
+
+// Fixes collected from the clang-tidy runs of many files, applied in one
+// pass per file once all runs are done. Files including the same header
+// typically come with the same fixes for it; these are applied only once.
+// A fix overlapping one collected earlier, or made for other content of
+// the file, is dropped as a whole.
+class FixApplier {
+ public:
+  struct Stats {
+    size_t fixes = 0;
+    size_t conflicts = 0;
+    size_t files = 0;
+    size_t stale_files = 0;  // Changed since the fixes were exported.
+    size_t unformatted_files = 0;
+  };
+
+  void Add(const std::vector<Fix> &fixes, bool with_notes) {
+    for (const Fix &fix : fixes) {
+      if (!fix.from_note || with_notes) {
+        Add(fix);
+      }
+    }
+  }
+
+  // Apply to all files, each with all its replacements written at once.
+  // Unless "format_style" is "none", the lines replaced are formatted
+  // with clang-format in that style afterwards, as clang-tidy would.
+  Stats Apply(std::string_view format_style) {
+    Stats stats = stats_;
+    for (auto &[file, target] : targets_) {
+      if (target.replacements.empty()) {
+        continue;
+      }
+      std::string content = GetContent(file);
+      if (hashContent(content) != target.hash ||
+          std::prev(target.replacements.end())->second.offset +
+                  std::prev(target.replacements.end())->second.length >
+              content.size()) {
+        ++stats.stale_files;
+        continue;
+      }
+      for (auto it = target.replacements.rbegin();
+           it != target.replacements.rend(); ++it) {
+        content.replace(it->second.offset, it->second.length, it->second.text);
+      }
+      if (!WriteFile(file, content)) {
+        continue;
+      }
+      ++stats.files;
+      if (!format_style.empty() && format_style != "none" &&
+          !Format(file, content, target.replacements, format_style)) {
+        ++stats.unformatted_files;
+      }
+    }
+    return stats;
+  }
+
+ private:
+  struct Target {
+    hash_t hash = 0;
+    std::map<uint64_t, Replacement> replacements;  // Non-overlapping.
+  };
+
+  void Add(const Fix &fix) {
+    std::vector<std::pair<Target *, uint64_t>> added;
+    bool conflict = false;
+    for (const Replacement &r : fix.replacements) {
+      Target &target = targets_[r.file.string()];
+      if (target.hash == 0) {
+        target.hash = r.file_hash;
+      }
+      conflict = target.hash != r.file_hash;  // Made for other content.
+      const auto next = target.replacements.upper_bound(r.offset);
+      if (!conflict && next != target.replacements.begin()) {
+        const Replacement &previous = std::prev(next)->second;
+        if (previous == r) {
+          continue;  // Same as already collected.
+        }
+        conflict = previous.offset == r.offset ||
+                   previous.offset + previous.length > r.offset;
+      }
+      conflict = conflict || (next != target.replacements.end() &&
+                              r.offset + r.length > next->second.offset);
+      if (conflict) {
+        break;
+      }
+      target.replacements.emplace(r.offset, r);
+      added.emplace_back(&target, r.offset);
+    }
+    if (conflict) {
+      for (const auto &[target, offset] : added) {
+        target->replacements.erase(offset);
+      }
+      ++stats_.conflicts;
+    } else if (!added.empty()) {
+      ++stats_.fixes;
+    }
+  }
+
+  // Format the lines of the new "content" of the file that the replacements
+  // were applied to.
+  static bool Format(const std::string &file, std::string_view content,
+                     const std::map<uint64_t, Replacement> &replacements,
+                     std::string_view format_style) {
+    std::vector<std::string> command = {
+        std::string(EnvWithFallback("CLANG_FORMAT", "clang-format")), "-i",
+        "--style=" + std::string(format_style)};
+    auto line_of = [&](uint64_t offset) {
+      return 1 + std::count(content.begin(), content.begin() + offset, '\n');
+    };
+    int64_t shift = 0;  // Of the offsets by replacements before.
+    for (const auto &[offset, r] : replacements) {
+      const uint64_t start = offset + shift;
+      const uint64_t end = start + std::max<uint64_t>(r.text.size(), 1) - 1;
+      command.push_back("--lines=" + std::to_string(line_of(start)) + ":" +
+                        std::to_string(line_of(end)));
+      shift += static_cast<int64_t>(r.text.size() - r.length);
+    }
+    command.push_back(file);
+    std::string out;
+    return RunProcess(command, &out) == 0;
+  }
+
+  // Written in place, as clang-tidy does, so that hard links, ownership,
+  // permissions and extended attributes of the file are kept.
+  static bool WriteFile(const fs::path &file, std::string_view content) {
+    FILE *out = fopen(file.c_str(), "r+b");
+    if (!out) {
+      fprintf(stderr, "%s: can't write: %s\n", file.c_str(), strerror(errno));
+      return false;
+    }
+    const bool success =
+        ftruncate(fileno(out), 0) == 0 &&
+        fwrite(content.data(), 1, content.size(), out) == content.size();
+    if (fclose(out) != 0 || !success) {
+      fprintf(stderr, "%s: can't write: %s\n", file.c_str(), strerror(errno));
+      return false;
+    }
+    return true;
+  }
+
+  std::map<std::string, Target> targets_;
+  Stats stats_;
+};
+
+// Claim on processing a file, so that concurrent invocations sharing a
+// cache directory don't run clang-tidy on the same file at the same time.
+// A claim is an flock() on a file in the claim directory; it is released
+// by the kernel if the process holding it dies, so there are no stale
+// claims to recover from.
+class WorkClaim {
+ public:
+  // Try to claim given work. If "wait" is set, wait until whoever else
+  // is holding it is done, unless "give_up" returns true meanwhile.
+  WorkClaim(const fs::path &claim_dir, const filepath_contenthash_t &work,
+            bool wait, const std::function<bool()> &give_up)
+      : path_(claim_dir / (work.first.filename().string() + "-" +
+                           ToHex(work.second) + ".lock")) {
+    for (;;) {
+      fd_ = open(path_.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+      if (fd_ < 0) {
+        std::error_code ec;
+        fs::create_directories(claim_dir, ec);
+        fd_ = open(path_.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+      }
+      if (fd_ < 0) {
+        claimed_ = true;  // Best effort: can't coordinate, just do it.
+        return;
+      }
+      bool locked = flock(fd_, LOCK_EX | LOCK_NB) == 0;
+      if (!locked && wait) {
+        locked = WaitForLock(fd_, give_up);
+      }
+      if (!locked) {
+        close(fd_);
+        fd_ = -1;
+        return;  // In use elsewhere.
+      }
+      // The previous holder removes the file when done; make sure we hold
+      // the lock on the file that is still there, not an unlinked one.
+      struct stat fd_stat, path_stat;
+      if (fstat(fd_, &fd_stat) == 0 && stat(path_.c_str(), &path_stat) == 0 &&
+          fd_stat.st_ino == path_stat.st_ino &&
+          fd_stat.st_dev == path_stat.st_dev) {
+        claimed_ = true;
+        return;
+      }
+      close(fd_);
+    }
+  }
+
+  WorkClaim(const WorkClaim &) = delete;
+  WorkClaim &operator=(const WorkClaim &) = delete;
+
+  ~WorkClaim() {
+    if (fd_ >= 0) {
+      unlink(path_.c_str());  // While still locked.
+      close(fd_);
+    }
+  }
+
+  bool claimed() const { return claimed_; }
+
+ private:
+  // Blocking flock() on a helper thread, so that we can stop waiting once
+  // "give_up" returns true. The helper locks a duplicate of "fd", which
+  // shares the lock. If we gave up, it keeps waiting on its own and closes
+  // the duplicate once it got the lock, which then releases it.
+  static bool WaitForLock(int fd, const std::function<bool()> &give_up) {
+    struct State {
+      std::mutex lock;
+      std::condition_variable done_cv;
+      bool done = false;
+      bool locked = false;
+    };
+    const int helper_fd = dup(fd);
+    if (helper_fd < 0) {
+      return false;
+    }
+    auto state = std::make_shared<State>();
+    std::thread([state, helper_fd]() {
+      int r;
+      while ((r = flock(helper_fd, LOCK_EX)) != 0 && errno == EINTR) {
+      }
+      close(helper_fd);
+      {
+        const std::lock_guard<std::mutex> lock(state->lock);
+        state->done = true;
+        state->locked = r == 0;
+      }
+      state->done_cv.notify_all();
+    }).detach();
+    std::unique_lock<std::mutex> lock(state->lock);
+    while (!state->done) {
+      if (give_up()) {
+        return false;
+      }
+      // Ctrl-C can't notify us, so check for it once in a while.
+      state->done_cv.wait_for(lock, std::chrono::milliseconds(100));
+    }
+    return state->locked;
+  }
+
+  const fs::path path_;
+  int fd_ = -1;
+  bool claimed_ = false;
+};
+
+class ClangTidyRunner {
+ public:
+  ClangTidyRunner(const std::string &cache_prefix,
+                  const std::vector<std::string> &extra_args,
+                  const CompilationDatabase &compilation_db)
+      : clang_tidy_(EnvWithFallback("CLANG_TIDY", "clang-tidy")),
+        clang_tidy_args_(AssembleArgs(extra_args)),
+        compilation_db_(compilation_db) {
+    project_cache_dir_ = AssembleProjectCacheDir(cache_prefix);
+  }
+
+  // Fixes are stored with this suffix next to the result of a file.
+  static constexpr std::string_view kFixesSuffix = ".fixes";
+
+  // With kConfig.files_from_compilation_db, the findings in the headers of
+  // a file are stored with this suffix next to its result.
+  static constexpr std::string_view kHeaderFindingsSuffix = ".header-findings";
+
+  // Runner using the same cache dir, passing additional arguments to
+  // clang-tidy, e.g. to only run some checks. It does not export fixes.
+  ClangTidyRunner WithExtraArgs(const std::vector<std::string> &args) const {
+    return ClangTidyRunner(*this, args);
+  }
+
+  const fs::path &project_cache_dir() const { return project_cache_dir_; }
+
+  // Let clang-tidy export the fixes of each file instead of applying them;
+  // these are stored with kFixesSuffix. Files are then processed one per
+  // invocation, as the fixes can't be told apart otherwise.
+  void set_export_fixes(bool export_fixes) { export_fixes_ = export_fixes; }
+
+  // Called with each file and its result as soon as it is stored, from
+  // whichever worker thread processed it.
+  using ResultListener =
+      std::function<void(const fs::path &file, std::string_view result)>;
+  void set_result_listener(ResultListener listener) {
+    result_listener_ = std::move(listener);
+  }
+
+  // Configuration clang-tidy uses apart from the checks enabled, preceded
+  // by its full version: results of another build are not reused.
+  std::string ConfigurationWithoutChecks() const {
+    std::vector<std::string> command = {clang_tidy_, "--dump-config"};
+    command.insert(command.end(), clang_tidy_args_.begin(),
+                   clang_tidy_args_.end());
+    std::string output;
+    if (RunProcess(command, &output) != 0) {
+      return "";
+    }
+    std::string result;
+    if (RunProcess({clang_tidy_, "--version"}, &result) != 0) {
+      return "";
+    }
+    bool in_checks = false;
+    ForEachLine(output, [&](std::string_view line, bool) {
+      if (!line.empty() && !isspace(line.front())) {
+        in_checks = line.substr(0, 7) == "Checks:";
+      }
+      if (!in_checks) {
+        result.append(line).append(1, '\n');
+      }
+    });
+    return result;
+  }
+
+  // Style to format fixes with: given with --format-style or else the
+  // FormatStyle of the configuration; "none" if not formatting.
+  std::string FormatStyle() const {
+    for (const std::string &arg : clang_tidy_args_) {
+      for (std::string_view flag : {"--format-style=", "-format-style="}) {
+        if (arg.rfind(flag, 0) == 0) {
+          return arg.substr(flag.size());
+        }
+      }
+    }
+    std::vector<std::string> command = {clang_tidy_, "--dump-config"};
+    command.insert(command.end(), clang_tidy_args_.begin(),
+                   clang_tidy_args_.end());
+    std::string output;
+    RunProcess(command, &output);
+    std::string result = "none";
+    ForEachLine(output, [&](std::string_view line, bool) {
+      if (line.substr(0, 12) == "FormatStyle:") {
+        line.remove_prefix(12);
+        const size_t start = line.find_first_not_of(" '\"");
+        const size_t end = line.find_last_not_of(" '\"");
+        if (start != std::string_view::npos) {
+          result = line.substr(start, end - start + 1);
+        }
+      }
+    });
+    return result;
+  }
+
+  // Checks enabled with the configuration and arguments.
+  std::vector<std::string> EnabledChecks() const {
+    std::vector<std::string> command = {clang_tidy_, "--list-checks"};
+    command.insert(command.end(), clang_tidy_args_.begin(),
+                   clang_tidy_args_.end());
+    std::string output;
+    std::vector<std::string> result;
+    if (RunProcess(command, &output) != 0) {
+      return result;
+    }
+    ForEachLine(output, [&](std::string_view line, bool) {
+      if (line.substr(0, 4) == "    " && line.size() > 4) {
+        result.emplace_back(line.substr(4));
+      }
+    });
+    return result;
+  }
+
+  // Given a work-queue in/out-file, process it. Empties work_queue.
+  // Unless "keep_order" is set, files likely of interest to the developer
+  // go first, otherwise files are processed longest-first as known from the
+  // history, which records the time each file took (see ScheduleWork()).
+  // If "combine" is given, it is called with each file and its output; the
+  // returned value is stored as result.
+  void RunClangTidyOn(
+      ContentAddressedStore &output_store,
+      const DependencyTracker &dependencies, FileHistory *history,
+      std::list<filepath_contenthash_t> *work_queue, bool keep_order = false,
+      const std::function<std::string(const fs::path &, std::string)>
+          &combine = {}) {
+    if (work_queue->empty()) {
+      return;
+    }
+    const int kJobs = GetJobCount();
+    const Schedule schedule =
+        keep_order ? Schedule{}
+                   : ScheduleWork(*history, kJobs, work_queue);
+    const auto start_time = std::chrono::steady_clock::now();
+
+    // Memory admission control: only start a job if the memory predicted
+    // for it from the last run still fits within the budget. Files without
+    // history are assumed to need the average.
+    const uint64_t memory_budget_kb = GetMemoryBudgetKb();
+    std::unordered_map<std::string, uint64_t> memory_estimate_kb;
+    uint64_t memory_known_sum = 0;
+    for (const filepath_contenthash_t &work : *work_queue) {
+      if (auto rss = history->MaxRss(work.first)) {
+        memory_estimate_kb[work.first.string()] = *rss;
+        memory_known_sum += *rss;
+      }
+    }
+    const uint64_t memory_average_kb =
+        memory_estimate_kb.empty()
+            ? 0
+            : memory_known_sum / memory_estimate_kb.size();
+    auto memory_needed_kb = [&](const filepath_contenthash_t &work) {
+      const auto found = memory_estimate_kb.find(work.first.string());
+      return found == memory_estimate_kb.end() ? memory_average_kb
+                                               : found->second;
+    };
+    uint64_t memory_in_use_kb = 0;  // Predicted for running jobs.
+    int running_jobs = 0;
+    std::condition_variable job_finished;
+
+    std::cerr << work_queue->size() << " files to process (w/ " << kJobs
+              << " jobs";
+    if (schedule.likely_of_interest > 0) {
+      std::cerr << ", " << schedule.likely_of_interest
+                << " with findings or changes first";
+    }
+    if (memory_budget_kb > 0 && memory_average_kb > 0) {
+      fprintf(stderr, ", %.1f GiB memory budget",
+              memory_budget_kb / (1024.0 * 1024));
+    }
+    std::cerr << ")...";
+
+    const bool print_progress = isatty(STDERR_FILENO);
+    if (!print_progress) {
+      std::cerr << "\n";
+    }
+
+    // Other invocations sharing the cache might work on the same files
+    // concurrently. Files claimed elsewhere are deferred to the end of the
+    // queue; when we get to them again, we wait for the claim and use the
+    // result if it is there by then.
+    const fs::path claim_dir = project_cache_dir_ / "claims";
+    const file_time run_start = file_time::clock::now();
+    auto done_elsewhere = [&](const filepath_contenthash_t &work) {
+      const auto result_key = dependencies.ResultKey(work);
+      return result_key && !output_store.NeedsRefresh(*result_key, run_start) &&
+             (!export_fixes_ ||
+              output_store.Lookup(*result_key, kFixesSuffix).has_value());
+    };
+    std::unordered_set<std::string> claimed_elsewhere;
+
+    // Files sharing a precompiled header are only batched with each other.
+    const fs::path pch_dir =
+        project_cache_dir_ / ("pch-" + std::to_string(getpid()));
+    std::vector<PrecompiledHeader> pchs;
+    const std::unordered_map<std::string, size_t> pch_of =
+        BuildPrecompiledHeaders(*work_queue, pch_dir, &pchs);
+    auto pch_index = [&](const filepath_contenthash_t &work) {
+      const auto found = pch_of.find(work.first.string());
+      return found == pch_of.end() ? pchs.size() : found->second;
+    };
+
+    // Ctrl-C only terminates the running clang-tidy processes; once one of
+    // them got it, or it was pressed while none was running, no new jobs are
+    // started.
+    const ScopedIgnoreInterrupt only_children_get_ctrl_c;
+    std::atomic<bool> interrupted = false;
+    auto got_ctrl_c = [&]() {
+      return interrupted || only_children_get_ctrl_c.received();
+    };
+    auto is_interrupt = [](int status) {
+      return WIFSIGNALED(status) &&
+             (WTERMSIG(status) == SIGINT || WTERMSIG(status) == SIGQUIT);
+    };
+    // Exported fixes and the findings in headers are per clang-tidy call;
+    // they can only be attributed to a file if it ran on its own.
+    const int kMaxBatchSize =
+        (export_fixes_ || kConfig.files_from_compilation_db) ? 1
+                                                             : GetBatchSize();
+    std::mutex queue_access_lock;
+    std::atomic<int> fixes_file_count = 0;
+    auto clang_tidy_runner = [&]() {
+      for (;;) {
+        std::vector<filepath_contenthash_t> batch;
+        uint64_t batch_memory_kb = 0;
+        std::optional<filepath_contenthash_t> wait_for;
+        {
+          std::unique_lock<std::mutex> lock(queue_access_lock);
+          // The next file waits until it fits in the memory budget; not
+          // letting smaller ones overtake it keeps the longest first. If
+          // nothing is running, everything fits, otherwise we'd never
+          // get to process large files.
+          auto fits = [&](const filepath_contenthash_t &work) {
+            return memory_budget_kb == 0 || running_jobs == 0 ||
+                   memory_in_use_kb + memory_needed_kb(work) <=
+                       memory_budget_kb;
+          };
+          auto claimed_elsewhere_before = [&](const filepath_contenthash_t &w) {
+            return claimed_elsewhere.count(w.first.string()) > 0;
+          };
+          for (;;) {
+            if (work_queue->empty() || got_ctrl_c()) {
+              return;
+            }
+            if (claimed_elsewhere_before(work_queue->front()) ||
+                fits(work_queue->front())) {
+              break;
+            }
+            job_finished.wait(lock);
+          }
+          if (print_progress) {
+            fprintf(stderr, "%5d\b\b\b\b\b", (int)(work_queue->size()));
+          }
+          if (claimed_elsewhere_before(work_queue->front())) {
+            // Wait for the claim below; without taking a job slot or
+            // memory, as we don't run anything meanwhile.
+            wait_for = work_queue->front();
+            work_queue->pop_front();
+            claimed_elsewhere.erase(wait_for->first.string());
+          } else {
+            // Header paths in the -H trace are relative to the directory
+            // the file is compiled in, so a batch needs to share it.
+            const size_t batch_pch = pch_index(work_queue->front());
+            const fs::path batch_dir =
+                compilation_db_.DirectoryOf(work_queue->front().first);
+            batch = TakeBatch(
+                kMaxBatchSize, kJobs,
+                [&](const filepath_contenthash_t &work) {
+                  return fits(work) && !claimed_elsewhere_before(work) &&
+                         pch_index(work) == batch_pch &&
+                         compilation_db_.DirectoryOf(work.first) == batch_dir;
+                },
+                work_queue);
+            for (const filepath_contenthash_t &work : batch) {
+              batch_memory_kb =
+                  std::max(batch_memory_kb, memory_needed_kb(work));
+            }
+            memory_in_use_kb += batch_memory_kb;
+            ++running_jobs;
+          }
+        }
+        if (wait_for) {
+          const WorkClaim claim(claim_dir, *wait_for, /*wait=*/true,
+                                got_ctrl_c);
+          if (claim.claimed() && done_elsewhere(*wait_for)) {
+            ++Tracer::Get().files_from_other_process;
+          } else if (claim.claimed()) {
+            // Not done after all, e.g. as the other invocation got Ctrl-C.
+            const std::lock_guard<std::mutex> lock(queue_access_lock);
+            work_queue->push_front(*wait_for);
+          }
+          continue;
+        }
+        std::vector<std::unique_ptr<WorkClaim>> claims;
+        for (auto it = batch.begin(); it != batch.end();) {
+          auto claim = std::make_unique<WorkClaim>(claim_dir, *it,
+                                                   /*wait=*/false, got_ctrl_c);
+          if (!claim->claimed()) {
+            const std::lock_guard<std::mutex> lock(queue_access_lock);
+            claimed_elsewhere.insert(it->first.string());
+            work_queue->push_back(*it);
+            it = batch.erase(it);
+          } else if (done_elsewhere(*it)) {
+            ++Tracer::Get().files_from_other_process;
+            it = batch.erase(it);
+          } else {
+            claims.push_back(std::move(claim));
+            ++it;
+          }
+        }
+        if (batch.empty()) {
+          {
+            const std::lock_guard<std::mutex> lock(queue_access_lock);
+            memory_in_use_kb -= batch_memory_kb;
+            --running_jobs;
+          }
+          job_finished.notify_all();
+          continue;
+        }
+        // Putting the files to clang-tidy early in the command line so that
+        // they are easy to find with `ps` or `top`.
+        std::vector<std::string> command = {clang_tidy_};
+        for (const filepath_contenthash_t &work : batch) {
+          command.push_back(work.first.string());
+        }
+        command.insert(command.end(), clang_tidy_args_.begin(),
+                       clang_tidy_args_.end());
+        const fs::path fixes_file =
+            project_cache_dir_ / ("fixes-" + std::to_string(getpid()) + "-" +
+                                  std::to_string(fixes_file_count++) + ".yaml");
+        if (export_fixes_) {
+          command.push_back("--export-fixes=" + fixes_file.string());
+        }
+        std::string files;
+        for (const filepath_contenthash_t &work : batch) {
+          files.append(files.empty() ? "" : " ").append(work.first.string());
+        }
+        std::string output;
+        std::string header_trace;
+        uint64_t max_rss_kb = 0;
+        const auto tidy_start = std::chrono::steady_clock::now();
+        auto run_clang_tidy = [&](const std::vector<std::string> &cmd) {
+          output.clear();
+          header_trace.clear();
+          return RunProcess(cmd, &output,
+                            kConfig.revisit_if_any_include_changes
+                                ? &header_trace
+                                : nullptr,
+                            &max_rss_kb);
+        };
+        const size_t batch_pch = pch_index(batch.front());
+        fs::path pch_file;
+        if (batch_pch < pchs.size()) {
+          const std::lock_guard<std::mutex> lock(queue_access_lock);
+          pch_file = pchs[batch_pch].file;
+        }
+        bool used_pch = !pch_file.empty();
+        int r;
+        if (used_pch) {
+          std::vector<std::string> pch_command = command;
+          pch_command.push_back("--extra-arg=-include-pch");
+          pch_command.push_back("--extra-arg=" + pch_file.string());
+          r = run_clang_tidy(pch_command);
+          auto about_pch = [&](std::string_view text) {
+            for (const std::string_view s :
+                 {std::string_view(pch_file.native()),
+                  std::string_view("precompiled header"),
+                  std::string_view("PCH file"),
+                  std::string_view("AST file")}) {
+              if (text.find(s) != std::string_view::npos) {
+                return true;
+              }
+            }
+            return false;
+          };
+          if (r != 0 && !is_interrupt(r) &&
+              (about_pch(output) || about_pch(header_trace))) {
+            // Can't use the precompiled header; try without.
+            used_pch = false;
+            {
+              const std::lock_guard<std::mutex> lock(queue_access_lock);
+              pchs[batch_pch].file.clear();  // Don't use for the rest.
+            }
+            r = run_clang_tidy(command);
+          }
+        } else {
+          r = run_clang_tidy(command);
+        }
+        if (is_interrupt(r)) {
+          interrupted = true;
+        }
+        {
+          const std::lock_guard<std::mutex> lock(queue_access_lock);
+          memory_in_use_kb -= batch_memory_kb;
+          --running_jobs;
+        }
+        job_finished.notify_all();
+        if (is_interrupt(r)) {
+          break;  // got Ctrl-C
+        }
+        const double seconds = SecondsSince(tidy_start);
+        Tracer &tracer = Tracer::Get();
+        tracer.AddSpan(files, "clang-tidy", tidy_start,
+                       "\"exit\":" + std::to_string(r) +
+                           ",\"max_rss_kb\":" + std::to_string(max_rss_kb));
+        tracer.AddJob(files, seconds, max_rss_kb);
+        tracer.files_processed += batch.size();
+
+        const ScopedSpan span("process output", "output");
+        const double seconds_per_file = seconds / batch.size();
+        std::vector<fs::path> headers = ExtractIncludedHeaders(
+            header_trace, compilation_db_.DirectoryOf(batch.front().first));
+        if (used_pch) {
+          // The compiler does not list headers read from the precompiled
+          // header, but the result depends on them just the same.
+          for (const fs::path &header : pchs[batch_pch].headers) {
+            if (std::find(headers.begin(), headers.end(), header) ==
+                headers.end()) {
+              headers.push_back(header);
+            }
+          }
+        }
+        // Fix filename paths found in the output that are not emitted
+        // relative to project root.
+        const std::string canonical_output =
+            RemovePathPrefixes(output, ProjectPathPrefixes());
+        std::string header_findings;
+        if (kConfig.files_from_compilation_db) {
+          std::unordered_set<std::string> basenames;
+          for (const filepath_contenthash_t &work : batch) {
+            basenames.insert(work.first.filename().string());
+          }
+          FilterOtherFilesCheckLines(basenames, canonical_output,
+                                     &header_findings);
+        }
+        std::string fixes;
+        if (export_fixes_) {
+          std::error_code ec;
+          if (fs::exists(fixes_file, ec)) {
+            fixes = ReadExportedFixes(fixes_file);
+            fs::remove(fixes_file, ec);
+          }
+        }
+        for (const filepath_contenthash_t &work : batch) {
+          const filepath_contenthash_t result_key =
+              dependencies.Record(work, headers);
+          std::string file_output;
+          FilterCheckLines(work.first.filename().string(), canonical_output,
+                           &file_output);
+          if (combine) {
+            file_output = combine(work.first, std::move(file_output));
+          }
+          if (export_fixes_) {
+            output_store.Store(result_key, fixes, kFixesSuffix);
+          }
+          if (kConfig.files_from_compilation_db) {
+            output_store.Store(result_key, header_findings,
+                               kHeaderFindingsSuffix);
+          }
+          output_store.Store(result_key, file_output);
+          // Memory is not divided in batches; it is what the process needed.
+          history->Record(work.first, seconds_per_file, max_rss_kb,
+                          !file_output.empty());
+          if (result_listener_) {
+            result_listener_(work.first, file_output);
+          }
+        }
+        claims.clear();  // Only release once results are published.
+      }
+    };
+
+    std::vector<std::thread> workers;
+    for (auto i = 0; i < kJobs; ++i) {
+      workers.emplace_back(clang_tidy_runner);  // NOLINT
+    }
+    for (auto &t : workers) {
+      t.join();
+    }
+    if (print_progress) {
+      fprintf(stderr, "     \n");  // Clean out progress counter.
+    }
+    if (!claimed_elsewhere.empty()) {
+      fprintf(stderr, "%zu files were claimed by another invocation.\n",
+              claimed_elsewhere.size());
+    }
+    if (!pchs.empty()) {
+      std::error_code ignored_error;
+      fs::remove_all(pch_dir, ignored_error);
+    }
+    if (schedule.known_durations > 0) {
+      fprintf(stderr,
+              "Predicted makespan %.1fs (%.1fs in directory order); "
+              "actual %.1fs.\n",
+              schedule.makespan, schedule.unsorted_makespan,
+              SecondsSince(start_time));
+    }
+  }
+
+ private:
+  ClangTidyRunner(const ClangTidyRunner &other,
+                  const std::vector<std::string> &extra_args)
+      : clang_tidy_(other.clang_tidy_),
+        clang_tidy_args_(other.clang_tidy_args_),
+        compilation_db_(other.compilation_db_),
+        project_cache_dir_(other.project_cache_dir_) {
+    clang_tidy_args_.insert(clang_tidy_args_.end(), extra_args.begin(),
+                            extra_args.end());
+  }
+
+  struct Schedule {
+    size_t likely_of_interest = 0;  // Put in front of the queue.
+    size_t known_durations = 0;
+    double makespan = 0;           // Predicted for the chosen order.
+    double unsorted_makespan = 0;  // Predicted for the original order.
+  };
+
+  struct PrecompiledHeader {
+    fs::path file;                  // Empty if it can't be used.
+    std::vector<fs::path> headers;  // Project headers it contains.
+  };
+
+  // Files with identical compile command that start with the same includes
+  // can share a precompiled header of these. Only worthwhile if there are
+  // enough of them.
+  static constexpr size_t kMinFilesPerPrecompiledHeader = 4;
+
+  // Build precompiled headers for groups of files in the work queue, if
+  // configured. Returns for each file using one the index in "pchs".
+  std::unordered_map<std::string, size_t> BuildPrecompiledHeaders(
+      const std::list<filepath_contenthash_t> &work_queue,
+      const fs::path &pch_dir, std::vector<PrecompiledHeader> *pchs) const {
+    std::unordered_map<std::string, size_t> result;
+    const std::string compiler{EnvWithFallback(
+        "CLANG_TIDY_PCH", kConfig.precompiled_header_compiler)};
+    if (compiler.empty()) {
+      return result;
+    }
+    const ScopedSpan span("precompiled headers");
+
+    // Files by identical compile command and language.
+    std::map<std::string, std::vector<fs::path>> groups;
+    for (const filepath_contenthash_t &work : work_queue) {
+      const CompilationDatabase::Command *command =
+          compilation_db_.CommandOf(work.first);
+      if (!command || IsIncludeExtension(work.first.extension().string())) {
+        continue;
+      }
+      std::string group_key = work.first.extension() == ".c" ? "c" : "c++";
+      group_key.append(1, '\0').append(command->directory);
+      for (const std::string &arg : command->args) {
+        group_key.append(1, '\0').append(arg);
+      }
+      groups[group_key].push_back(work.first);
+    }
+
+    struct Job {
+      const CompilationDatabase::Command *command;
+      std::string language;
+      std::vector<std::string> includes;
+      std::vector<fs::path> files;
+    };
+    std::vector<Job> jobs;
+    for (const auto &[group_key, files] : groups) {
+      if (files.size() < kMinFilesPerPrecompiledHeader) {
+        continue;
+      }
+      // The prefix of includes that saves the most parsing: shared by many
+      // files and long.
+      std::vector<std::vector<std::string>> includes;
+      std::unordered_map<std::string, size_t> prefix_count;
+      for (const fs::path &file : files) {
+        includes.push_back(LeadingIncludes(file));
+        std::string prefix;
+        for (const std::string &include : includes.back()) {
+          prefix.append(include).append("\n");
+          ++prefix_count[prefix];
+        }
+      }
+      std::string best_prefix;
+      size_t best_saving = 0;
+      for (const auto &[prefix, count] : prefix_count) {
+        const size_t length = std::count(prefix.begin(), prefix.end(), '\n');
+        if (count >= kMinFilesPerPrecompiledHeader &&
+            (count * length > best_saving ||
+             (count * length == best_saving && prefix < best_prefix))) {
+          best_saving = count * length;
+          best_prefix = prefix;
+        }
+      }
+      if (best_prefix.empty()) {
+        continue;
+      }
+      Job job;
+      job.command = compilation_db_.CommandOf(files.front());
+      job.language = group_key.substr(0, group_key.find('\0'));
+      ForEachLine(best_prefix, [&](std::string_view include, bool) {
+        job.includes.emplace_back(include);
+      });
+      for (size_t i = 0; i < files.size(); ++i) {
+        if (includes[i].size() >= job.includes.size() &&
+            std::equal(job.includes.begin(), job.includes.end(),
+                       includes[i].begin())) {
+          job.files.push_back(files[i]);
+        }
+      }
+      jobs.push_back(std::move(job));
+    }
+    if (jobs.empty()) {
+      return result;
+    }
+
+    fs::create_directories(pch_dir);
+    pchs->resize(jobs.size());
+    ParallelFor(jobs.size(), GetJobCount(), [&](size_t i) {
+      const Job &job = jobs[i];
+      const fs::path preamble = pch_dir / (std::to_string(i) + ".h");
+      std::string preamble_content;
+      for (const std::string &include : job.includes) {
+        preamble_content.append("#include ").append(include).append("\n");
+      }
+      FILE *out = fopen(preamble.c_str(), "wb");
+      if (!out) {
+        return;
+      }
+      fwrite(preamble_content.data(), 1, preamble_content.size(), out);
+      fclose(out);
+
+      const fs::path pch_file = pch_dir / (std::to_string(i) + ".pch");
+      std::vector<std::string> command = {
+          compiler, "-working-directory=" + job.command->directory};
+      command.insert(command.end(), job.command->args.begin() + 1,
+                     job.command->args.end());
+      for (const std::string_view arg : kExtraArgs) {
+        command.emplace_back(arg);
+      }
+      if (kConfig.revisit_if_any_include_changes) {
+        command.emplace_back("-H");
+      }
+      command.insert(command.end(), {"-x", job.language + "-header",
+                                     preamble.string(), "-o",
+                                     pch_file.string()});
+      std::string output;
+      std::string header_trace;
+      if (RunProcess(command, &output, &header_trace) == 0) {
+        (*pchs)[i].file = fs::absolute(pch_file);
+        (*pchs)[i].headers =
+            ExtractIncludedHeaders(header_trace, job.command->directory);
+      }
+    });
+
+    size_t file_count = 0;
+    for (size_t i = 0; i < jobs.size(); ++i) {
+      if ((*pchs)[i].file.empty()) {
+        std::cerr << "Could not build precompiled header for "
+                  << jobs[i].files.size() << " files; processing without.\n";
+        continue;
+      }
+      for (const fs::path &file : jobs[i].files) {
+        result[file.string()] = i;
+      }
+      file_count += jobs[i].files.size();
+    }
+    if (file_count > 0) {
+      std::cerr << "Precompiled headers for " << file_count << " files.\n";
+    }
+    return result;
+  }
+
+  // The #include lines a file starts with (only preceded by comments).
+  // Quoted includes that are found relative to the file stop the list, as
+  // in a precompiled header, they would not be found the same way.
+  static std::vector<std::string> LeadingIncludes(const fs::path &file) {
+    static constexpr size_t kMaxIncludes = 64;
+    std::vector<std::string> result;
+    const std::string content = GetContent(file);
+    bool in_comment = false;
+    bool done = false;
+    ForEachLine(content, [&](std::string_view line, bool) {
+      if (done) {
+        return;
+      }
+      if (in_comment) {
+        const size_t end = line.find("*/");
+        if (end == std::string_view::npos) {
+          return;
+        }
+        line.remove_prefix(end + 2);
+        in_comment = false;
+      }
+      while (!line.empty() && isspace(line.front())) {
+        line.remove_prefix(1);
+      }
+      while (!line.empty() && isspace(line.back())) {
+        line.remove_suffix(1);
+      }
+      if (line.empty() || line.substr(0, 2) == "//") {
+        return;
+      }
+      if (line.substr(0, 2) == "/*") {
+        in_comment = line.find("*/", 2) == std::string_view::npos;
+        done = !in_comment && line.substr(line.size() - 2) != "*/";
+        return;
+      }
+      std::string_view include = line;
+      if (include.substr(0, 1) != "#") {
+        done = true;
+        return;
+      }
+      include.remove_prefix(1);
+      while (!include.empty() && isspace(include.front())) {
+        include.remove_prefix(1);
+      }
+      if (include.substr(0, 7) != "include") {
+        done = true;
+        return;
+      }
+      include.remove_prefix(7);
+      while (!include.empty() && isspace(include.front())) {
+        include.remove_prefix(1);
+      }
+      const size_t end = include.find_first_of(">\"", 1);
+      std::error_code ec;
+      if (include.empty() || end == std::string_view::npos ||
+          (include[0] != '<' && include[0] != '"') ||
+          (include[0] == '"' &&
+           fs::exists(file.parent_path() / include.substr(1, end - 1), ec)) ||
+          result.size() >= kMaxIncludes) {
+        done = true;
+        return;
+      }
+      result.emplace_back(include.substr(0, end + 1));
+    });
+    return result;
+  }
+
+  // Take the next files to process from the queue. To keep all jobs busy
+  // until the end, the batch is at most a fraction of the remaining work.
+  // Files are only batched if their basename is distinct, as this is what
+  // the output is split by, and if they "fit" in terms of memory. Headers
+  // are processed on their own: a translation unit in the same batch might
+  // report findings in them, which would end up in the header's result.
+  template <typename FitsFun>
+  static std::vector<filepath_contenthash_t> TakeBatch(
+      int max_batch_size, int jobs, FitsFun fits,
+      std::list<filepath_contenthash_t> *work_queue) {
+    const size_t batch_size = std::clamp<size_t>(
+        work_queue->size() / (2 * jobs), 1, max_batch_size);
+    auto is_header = [](const filepath_contenthash_t &work) {
+      return IsIncludeExtension(work.first.extension().string());
+    };
+    std::vector<filepath_contenthash_t> batch;
+    std::unordered_set<std::string> basenames;
+    while (!work_queue->empty() && batch.size() < batch_size &&
+           (batch.empty() ||
+            (!is_header(batch.front()) && !is_header(work_queue->front()) &&
+             fits(work_queue->front()))) &&
+           basenames.insert(work_queue->front().first.filename().string())
+               .second) {
+      batch.push_back(work_queue->front());
+      work_queue->pop_front();
+    }
+    return batch;
+  }
+
+  static double SecondsSince(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() -
+                                         start)
+        .count();
+  }
+
+  // Total time when distributing the given durations in sequence to
+  // whichever of the jobs becomes available first.
+  static double PredictMakespan(const std::vector<double> &durations,
+                                int jobs) {
+    std::priority_queue<double, std::vector<double>, std::greater<double>>
+        job_done_time;
+    for (int i = 0; i < jobs; ++i) {
+      job_done_time.push(0);
+    }
+    double makespan = 0;
+    for (const double duration : durations) {
+      const double done = job_done_time.top() + duration;
+      job_done_time.pop();
+      job_done_time.push(done);
+      makespan = std::max(makespan, done);
+    }
+    return makespan;
+  }
+
+  // Order work queue to first give feedback on what the developer is likely
+  // working on: files that had findings the last time and files modified
+  // since the last run (or the last day if there is no history). Within
+  // these and the other files, longest-processing-time first. Files without
+  // history (typically new ones) are assumed to take the average time.
+  static Schedule ScheduleWork(const FileHistory &history, int jobs,
+                               std::list<filepath_contenthash_t> *work_queue) {
+    const ScopedSpan span("schedule");
+    Schedule result;
+    const file_time recent = history.LastSaved().value_or(
+        file_time::clock::now() - std::chrono::hours(24));
+    std::unordered_set<std::string> of_interest;
+    std::unordered_map<std::string, double> estimate;
+    double known_sum = 0;
+    for (const filepath_contenthash_t &work : *work_queue) {
+      std::error_code ec;
+      if (history.HadFindings(work.first) ||
+          fs::last_write_time(work.first, ec) > recent) {
+        of_interest.insert(work.first.string());
+      }
+      if (auto duration = history.Duration(work.first)) {
+        estimate[work.first.string()] = *duration;
+        known_sum += *duration;
+        ++result.known_durations;
+      }
+    }
+    result.likely_of_interest = of_interest.size();
+    auto is_of_interest = [&](const filepath_contenthash_t &work) {
+      return of_interest.count(work.first.string()) > 0;
+    };
+    if (result.known_durations == 0) {
+      // Nothing to go by otherwise; keep directory order.
+      work_queue->sort([&](const auto &a, const auto &b) {
+        return is_of_interest(a) && !is_of_interest(b);
+      });
+      return result;
+    }
+    const double average = known_sum / result.known_durations;
+    auto estimate_of = [&](const filepath_contenthash_t &work) {
+      const auto found = estimate.find(work.first.string());
+      return found == estimate.end() ? average : found->second;
+    };
+    std::vector<double> durations;
+    for (const filepath_contenthash_t &work : *work_queue) {
+      durations.push_back(estimate_of(work));
+    }
+    result.unsorted_makespan = PredictMakespan(durations, jobs);
+
+    work_queue->sort([&](const auto &a, const auto &b) {
+      if (is_of_interest(a) != is_of_interest(b)) {
+        return is_of_interest(a);
+      }
+      return estimate_of(a) > estimate_of(b);
+    });
+    durations.clear();
+    for (const filepath_contenthash_t &work : *work_queue) {
+      durations.push_back(estimate_of(work));
+    }
+    result.makespan = PredictMakespan(durations, jobs);
+    return result;
+  }
+
+  static fs::path GetCacheBaseDir() {
+    if (const char *from_env = getenv("CACHE_DIR")) {
+      return fs::path{from_env};
+    }
+    if (const char *home = getenv("HOME")) {
+      if (auto cdir = fs::path(home) / ".cache/"; fs::exists(cdir)) {
+        return cdir;
+      }
+    }
+    return fs::path{EnvWithFallback("TMPDIR", "/tmp")};
+  }
+
+  static std::vector<std::string> AssembleArgs(
+      const std::vector<std::string> &extra_args) {
+    std::vector<std::string> result = {"--quiet"};
+    if (!UseHierarchicalConfigs()) {
+      result.push_back("--config-file=" + std::string{GetClangTidyConfig()});
+    }
+    for (const std::string_view arg : kExtraArgs) {
+      result.push_back("--extra-arg=" + std::string{arg});
+    }
+    if (kConfig.revisit_if_any_include_changes) {
+      // Let the compiler list all the headers it includes on stderr.
+      result.emplace_back("--extra-arg=-H");
+    }
+    if (kConfig.files_from_compilation_db) {
+      // Headers are checked through the translation units including them.
+      result.emplace_back("--header-filter=.*");
+    }
+    result.insert(result.end(), extra_args.begin(), extra_args.end());
+    return result;
+  }
+
+  fs::path AssembleProjectCacheDir(const std::string &cache_prefix) const {
+    const fs::path cache_dir = GetCacheBaseDir() / "clang-tidy";
+
+    // Use major version as part of name of our configuration specific dir.
+    std::string version;
+    RunProcess({clang_tidy_, "--version"}, &version);
+    if (version.empty()) {
+      std::cerr << "Could not invoke " << clang_tidy_ << "; is it in PATH ?\n";
+      exit(EXIT_FAILURE);
+    }
+    std::smatch version_match;
+    const std::string major_version =
+        std::regex_search(version, version_match,
+                          std::regex{"version ([0-9]+)"})
+            ? version_match[1].str()
+            : "UNKNOWN";
+
+    // Make sure directory filename depends on .clang-tidy content.
+    std::string version_and_args = version;
+    for (const std::string &arg : clang_tidy_args_) {
+      version_and_args.append(" ").append(arg);
+    }
+    hash_t cache_unique_id = hashContent(version_and_args);
+    if (!UseHierarchicalConfigs()) {
+      // Otherwise, the configuration is part of each file's key.
+      cache_unique_id ^= hashContent(GetContent(GetClangTidyConfig()));
+    }
+    return cache_dir / fs::path(cache_prefix + "v" + major_version + "_" +
+                                ToHex(cache_unique_id, 8));
+  }
+
+  // Path prefixes that are not emitted relative to the project root in the
+  // output, such as $(pwd)/ (bazel has its own, so if this is bazel, also
+  // include the bazel-specific one).
+  static const std::vector<std::string> &ProjectPathPrefixes() {
+    static const std::vector<std::string> sPrefixes = []() {
+      std::vector<std::string> result;
+      if (kConfig.is_bazel_project) {
+        auto bzroot = GetCommandOutput("bazel info execution_root 2>/dev/null");
+        if (!bzroot.empty()) {
+          bzroot.pop_back();  // remove newline.
+          result.push_back(bzroot + "/");
+        }
+      }
+      result.push_back(fs::current_path().string() + "/");  // $(pwd)/
+      return result;
+    }();
+    return sPrefixes;
+  }
+
+  // Extract the project headers from the output of the -H compiler option,
+  // which lists every included header on a line prefixed with dots
+  // signifying the nesting depth. Relative paths are relative to the
+  // "directory" the file was compiled in (the current directory if empty).
+  // Headers outside the project (such as system headers) are not of
+  // interest.
+  static std::vector<fs::path> ExtractIncludedHeaders(
+      std::string_view in, const fs::path &directory) {
+    std::vector<fs::path> result;
+    std::unordered_set<std::string_view> seen_raw;  // Views into "in".
+    std::unordered_set<std::string> seen;
+    ForEachLine(in, [&](std::string_view line, bool) {
+      const size_t depth = line.find_first_not_of('.');
+      if (depth == 0 || depth == std::string_view::npos || line[depth] != ' ') {
+        return;
+      }
+      const std::string_view header = line.substr(depth + 1);
+      if (!seen_raw.insert(header).second) {
+        return;  // Headers are typically included many times.
+      }
+      fs::path header_path(header);
+      if (header_path.is_relative() && !directory.empty()) {
+        header_path = directory / header_path;
+      }
+      const std::optional<fs::path> path =
+          ProjectRelative(header_path.lexically_normal().string());
+      if (!path) {
+        return;
+      }
+      std::error_code ec;
+      if (seen.insert(path->string()).second &&
+          fs::is_regular_file(*path, ec)) {
+        result.push_back(*path);
+      }
+    });
+    return result;
+  }
+
+  // Path relative to the project root; empty optional if outside.
+  static std::optional<fs::path> ProjectRelative(std::string_view path) {
+    for (const std::string &prefix : ProjectPathPrefixes()) {
+      if (path.substr(0, prefix.size()) == prefix) {
+        path.remove_prefix(prefix.size());
+        break;
+      }
+    }
+    fs::path result = fs::path(path).lexically_normal();
+    if (result.is_absolute() || result.string().rfind("..", 0) == 0) {
+      return std::nullopt;
+    }
+    return result;
+  }
+
+  // The fixes clang-tidy exported to "fixes_file", serialized to be cached.
+  // Paths are made relative to the project and the content hash of each
+  // file is recorded, as the offsets only apply to that. Fixes touching
+  // files outside the project are dropped.
+  static std::string ReadExportedFixes(const fs::path &fixes_file) {
+    std::vector<Fix> fixes = ParseExportedFixes(GetContent(fixes_file));
+    std::unordered_map<std::string, hash_t> hash_of;
+    auto in_project = [&](Replacement &r) {
+      const std::optional<fs::path> path = ProjectRelative(r.file.string());
+      std::error_code ec;
+      if (!path || !fs::is_regular_file(*path, ec)) {
+        return false;
+      }
+      r.file = *path;
+      auto [it, inserted] = hash_of.emplace(path->string(), 0);
+      if (inserted) {
+        it->second = hashContent(GetContent(*path));
+      }
+      r.file_hash = it->second;
+      return true;
+    };
+    fixes.erase(std::remove_if(fixes.begin(), fixes.end(),
+                               [&](Fix &fix) {
+                                 return !std::all_of(fix.replacements.begin(),
+                                                     fix.replacements.end(),
+                                                     in_project);
+                               }),
+                fixes.end());
+    return SerializeFixes(fixes);
+  }
+
+  const std::string clang_tidy_;
+  std::vector<std::string> clang_tidy_args_;
+  const CompilationDatabase &compilation_db_;
+  fs::path project_cache_dir_;
+  bool export_fixes_ = false;
+  ResultListener result_listener_;
+};
+
+// Persisted aggregate of the report of a checkout: per file the findings per
+// check and the location of its section in the detailed report. With that,
+// only the contributions of files that changed since the last run need to
+// be updated.
+class ReportAggregate {
+ public:
+  struct FileEntry {
+    hash_t result_hash = 0;  // Content hash of the result key.
+    uint64_t offset = 0;     // Section in the detailed report.
+    uint64_t length = 0;
+    std::map<std::string, int> checks;
+  };
+
+  explicit ReportAggregate(const fs::path &index_file)
+      : index_file_(index_file) {}
+
+  // Load the aggregate if it describes the given detailed report.
+  bool Load(const fs::path &detail_report) {
+    FILE *in = fopen(index_file_.string().c_str(), "rb");
+    if (!in) {
+      return false;
+    }
+    uint64_t expected_size = 0;
+    char line[8192];
+    while (fgets(line, sizeof(line), in)) {
+      FileEntry e;
+      int checks_start = 0;
+      int checks_end = 0;
+      int path_start = 0;
+      if (sscanf(line, "%" SCNx64 " %" SCNu64 " %" SCNu64 " %n%*s%n %n",
+                 &e.result_hash, &e.offset, &e.length, &checks_start,
+                 &checks_end, &path_start) < 3 ||
+          path_start == 0) {
+        continue;
+      }
+      ParseChecks({line + checks_start, size_t(checks_end - checks_start)},
+                  &e.checks);
+      std::string file(line + path_start);
+      if (!file.empty() && file.back() == '\n') {
+        file.pop_back();
+      }
+      expected_size += e.length;
+      entries_.emplace(std::move(file), std::move(e));
+    }
+    fclose(in);
+    std::error_code ec;
+    const uint64_t actual_size = fs::file_size(detail_report, ec);
+    if (ec || actual_size != expected_size) {
+      entries_.clear();  // Report does not match; start from scratch.
+      return false;
+    }
+    return true;
+  }
+
+  // Remove entry of given file from the aggregate and return it.
+  std::optional<FileEntry> Take(const std::string &file) {
+    auto node = entries_.extract(file);
+    if (node.empty()) {
+      return std::nullopt;
+    }
+    return std::move(node.mapped());
+  }
+
+  void Add(const std::string &file, FileEntry entry) {
+    ordered_files_.push_back(file);
+    entries_[file] = std::move(entry);
+  }
+
+  // Entries not taken out or added.
+  const std::unordered_map<std::string, FileEntry> &entries() const {
+    return entries_;
+  }
+
+  void Save() const {
+    const std::string tmp_file =
+        index_file_.string() + "." + std::to_string(getpid()) + ".tmp";
+    FILE *out = fopen(tmp_file.c_str(), "wb");
+    if (!out) {
+      return;  // Best effort. Next time, the report is built from scratch.
+    }
+    for (const std::string &file : ordered_files_) {
+      const FileEntry &e = entries_.at(file);
+      std::string checks;
+      for (const auto &[check, count] : e.checks) {
+        checks.append(checks.empty() ? "" : ",")
+            .append(check)
+            .append("=")
+            .append(std::to_string(count));
+      }
+      fprintf(out, "%016" PRIx64 " %" PRIu64 " %" PRIu64 " %s %s\n",
+              e.result_hash, e.offset, e.length,
+              checks.empty() ? "-" : checks.c_str(), file.c_str());
+    }
+    if (fclose(out) == 0) {
+      fs::rename(tmp_file, index_file_);  // atomic replacement
+    }
+  }
+
+ private:
+  // Parse "[check-a]=3,[check-b]=1" ("-" if there are none).
+  static void ParseChecks(std::string_view in,
+                          std::map<std::string, int> *checks) {
+    while (!in.empty() && in != "-") {
+      const size_t end = std::min(in.find(','), in.size());
+      const std::string_view item = in.substr(0, end);
+      const size_t eq = item.rfind('=');
+      if (eq != std::string_view::npos) {
+        (*checks)[std::string(item.substr(0, eq))] +=
+            atoi(std::string(item.substr(eq + 1)).c_str());
+      }
+      in.remove_prefix(std::min(end + 1, in.size()));
+    }
+  }
+
+  const fs::path index_file_;
+  std::unordered_map<std::string, FileEntry> entries_;
+  std::vector<std::string> ordered_files_;  // Added in this order.
+};
+
+// Detailed report while clang-tidy is still running: starting out with the
+// results known so far, the findings of each file are appended as soon as
+// they are there. It is removed once the final report replaces it.
+class LiveReport {
+ public:
+  explicit LiveReport(const fs::path &report)
+      : report_(report), out_(fopen(report.string().c_str(), "ab")) {}
+  LiveReport(const LiveReport &) = delete;
+  LiveReport &operator=(const LiveReport &) = delete;
+
+  ~LiveReport() {
+    if (out_) {
+      fclose(out_);
+    }
+    std::error_code ignored_error;
+    fs::remove(report_, ignored_error);
+  }
+
+  bool ok() const { return out_ != nullptr; }
+
+  // Thread-safe.
+  void Append(const fs::path &file, std::string_view result) {
+    if (result.empty()) {
+      return;
+    }
+    const std::lock_guard<std::mutex> lock(lock_);
+    fprintf(out_, "%s:\n", file.string().c_str());
+    fwrite(result.data(), 1, result.size(), out_);
+    fflush(out_);  // Make visible to whoever is looking right now.
+  }
+
+ private:
+  const fs::path report_;
+  FILE *const out_;
+  std::mutex lock_;
+};
+
+class FileGatherer {
+ public:
+  FileGatherer(ContentAddressedStore &store, ContentHasher &hasher,
+               const DependencyTracker &dependencies,
+               const CompilationDatabase &compilation_db,
+               std::string_view search_dir)
+      : store_(store),
+        hasher_(hasher),
+        dependencies_(dependencies),
+        compilation_db_(compilation_db),
+        root_dir_(search_dir.empty() ? "." : search_dir) {}
+
+  // Find all the files we're interested in below the search dir.
+  void FindFiles() {
+    found_all_files_ = true;
+    if (EnvWithFallback("CLANG_TIDY_FILE_LIST", kConfig.file_list) != "git" ||
+        !FindFilesWithGit()) {
+      WalkFiles();
+    }
+    std::cerr << files_of_interest_.size() << " files of interest.\n";
+  }
+
+  // Instead of looking at all files, only use the given ones. Optionally
+  // also consider all files that included any of them in their last run;
+  // given files that don't exist (anymore) are only used for that.
+  void UseFiles(const std::vector<fs::path> &files, bool add_dependents) {
+    std::unordered_set<std::string> files_seen;
+    for (const fs::path &file : files) {
+      std::error_code ec;
+      const fs::path p = file.lexically_normal();
+      if (files_seen.insert(p.string()).second && IsFileOfInterest(p) &&
+          fs::is_regular_file(p, ec)) {
+        files_of_interest_.emplace_back(p, 0);
+      }
+    }
+    const size_t direct_count = files_of_interest_.size();
+    if (add_dependents && kConfig.revisit_if_any_include_changes) {
+      // All files hashed in the last run are candidates; those that did not
+      // change since still have the same hash, so their manifest is found.
+      for (const fs::path &p : FindDependents(
+               files_seen, hasher_.IndexedFiles(), /*is_key=*/false)) {
+        std::error_code ec;
+        if (IsFileOfInterest(p) && fs::is_regular_file(p, ec) &&
+            files_seen.insert(p.string()).second) {
+          files_of_interest_.emplace_back(p, 0);
+        }
+      }
+    }
+    std::cerr << files_of_interest_.size() << " files of interest ("
+              << files_of_interest_.size() - direct_count
+              << " depending on them).\n";
+  }
+
+  // Only keep the files belonging to shard "index" (1-based) of "count".
+  // Files are handed out heaviest-first to the shard with the least work so
+  // far, so that all shards take about the same time. Weights are the time
+  // the files took as listed in "weights_file" (see WriteShardWeights()),
+  // or, without one, the file sizes. The partition only depends on the
+  // files and these, so it is the same on all nodes.
+  void KeepShard(int index, int count,
+                 const std::optional<fs::path> &weights_file) {
+    std::unordered_map<std::string, double> durations;
+    if (weights_file) {
+      durations = ReadShardWeights(*weights_file);
+    }
+    std::vector<double> weight(files_of_interest_.size(), -1);
+    double known_sum = 0;
+    size_t known_count = 0;
+    for (size_t i = 0; i < files_of_interest_.size(); ++i) {
+      const filepath_contenthash_t &f = files_of_interest_[i];
+      if (!weights_file) {
+        std::error_code ec;
+        const uintmax_t size = fs::file_size(f.first, ec);
+        weight[i] = ec ? 0 : size;
+        continue;
+      }
+      const auto found = durations.find(f.first.string());
+      if (found != durations.end()) {
+        weight[i] = found->second;
+        known_sum += found->second;
+        ++known_count;
+      }
+    }
+    const double average = known_count ? known_sum / known_count : 1.0;
+    std::vector<size_t> order;
+    for (size_t i = 0; i < files_of_interest_.size(); ++i) {
+      if (weight[i] < 0) {
+        weight[i] = average;
+      }
+      order.push_back(i);
+    }
+    // Independent of the order files were found in.
+    std::sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+      if (weight[a] != weight[b]) {
+        return weight[a] > weight[b];
+      }
+      return files_of_interest_[a].first < files_of_interest_[b].first;
+    });
+    std::vector<double> shard_load(count);
+    std::vector<char> keep(files_of_interest_.size());
+    for (const size_t i : order) {
+      const size_t shard =
+          std::min_element(shard_load.begin(), shard_load.end()) -
+          shard_load.begin();
+      shard_load[shard] += weight[i];
+      keep[i] = (shard == size_t(index - 1));
+    }
+    std::vector<filepath_contenthash_t> kept;
+    for (size_t i = 0; i < files_of_interest_.size(); ++i) {
+      if (keep[i]) {
+        kept.push_back(files_of_interest_[i]);
+      }
+    }
+    files_of_interest_ = std::move(kept);
+    fprintf(stderr, "%zu files in shard %d/%d", files_of_interest_.size(),
+            index, count);
+    if (known_count > 0) {
+      fprintf(stderr, " (predicted %.1fs of %.1fs total)",
+              shard_load[index - 1],
+              std::accumulate(shard_load.begin(), shard_load.end(), 0.0));
+    }
+    fprintf(stderr, ".\n");
+  }
+
+  // Write the time each file of interest took as known from the history,
+  // to be used by all nodes of the next distributed run with KeepShard().
+  // One line per file: <seconds> <path>
+  bool WriteShardWeights(const fs::path &weights_file,
+                         const FileHistory &history) const {
+    const std::string tmp_file =
+        weights_file.string() + "." + std::to_string(getpid()) + ".tmp";
+    FILE *out = fopen(tmp_file.c_str(), "wb");
+    if (!out) {
+      return false;
+    }
+    for (const filepath_contenthash_t &f : files_of_interest_) {
+      if (auto duration = history.Duration(f.first)) {
+        fprintf(out, "%.3f %s\n", *duration, f.first.c_str());
+      }
+    }
+    if (fclose(out) != 0) {
+      return false;
+    }
+    std::error_code ec;
+    fs::rename(tmp_file, weights_file, ec);  // atomic replacement
+    return !ec;
+  }
+
+  // Assemble a list of paths that need refreshing.
+  // (FindFiles() or UseFiles() needs to be called first).
+  std::list<filepath_contenthash_t> BuildWorkList(file_time min_freshness) {
+    // Mostly stat() and reading files, so do that in parallel.
+    Tracer::Get().files_considered += files_of_interest_.size();
+    needs_refresh_.resize(files_of_interest_.size());
+    result_keys_.resize(files_of_interest_.size());
+    ParallelFor(files_of_interest_.size(), GetJobCount(),
+                [&](size_t i) { Evaluate(i, min_freshness); });
+
+    std::list<filepath_contenthash_t> work_queue;
+    for (size_t i = 0; i < files_of_interest_.size(); ++i) {
+      if (needs_refresh_[i]) {
+        work_queue.emplace_back(files_of_interest_[i]);
+      }
+    }
+    return work_queue;
+  }
+
+  // Start over after losing track of changes: find all files again (unless
+  // only given files are used) and look at each of them.
+  std::list<filepath_contenthash_t> RebuildWorkList(file_time min_freshness) {
+    config_chain_.Clear();
+    if (found_all_files_) {
+      files_of_interest_.clear();
+      FindFiles();
+    }
+    return BuildWorkList(min_freshness);
+  }
+
+  // Given files that changed since the last BuildWorkList() or
+  // UpdateWorkList() (in the order they changed), update the state of them
+  // and the files depending on them. Returns the files that need refreshing;
+  // most recently changed files first, then files depending on them.
+  std::list<filepath_contenthash_t> UpdateWorkList(
+      const std::vector<fs::path> &changed_files, file_time min_freshness) {
+    // Files processed in the last round got new result keys.
+    for (size_t i = 0; i < files_of_interest_.size(); ++i) {
+      if (needs_refresh_[i]) {
+        result_keys_[i] = dependencies_.ResultKey(files_of_interest_[i]);
+        needs_refresh_[i] = false;
+      }
+    }
+
+    std::unordered_set<std::string> changed;
+    std::vector<std::string> changed_config_dirs;
+    for (const fs::path &file : changed_files) {
+      changed.insert(file.lexically_normal().string());
+      hasher_.Forget(file.lexically_normal());
+      if (file.filename() == ".clang-tidy") {
+        const std::string dir = file.lexically_normal().parent_path().string();
+        changed_config_dirs.push_back(dir.empty() ? dir : dir + "/");
+      }
+    }
+    if (!changed_config_dirs.empty()) {
+      config_chain_.Clear();
+    }
+    // Dependents are found with their manifest under their current key,
+    // so this needs to happen before re-evaluating any of them.
+    std::unordered_set<std::string> dependents;
+    for (const fs::path &p : FindDependents(changed, files_of_interest_)) {
+      dependents.insert(p.string());
+    }
+
+    // Drop deleted files, add new ones.
+    std::unordered_map<std::string, size_t> index_of;
+    for (size_t i = 0; i < files_of_interest_.size();) {
+      std::error_code ec;
+      if (changed.count(files_of_interest_[i].first.string()) &&
+          !fs::is_regular_file(files_of_interest_[i].first, ec)) {
+        files_of_interest_.erase(files_of_interest_.begin() + i);
+        needs_refresh_.erase(needs_refresh_.begin() + i);
+        result_keys_.erase(result_keys_.begin() + i);
+        continue;
+      }
+      index_of[files_of_interest_[i].first.string()] = i;
+      ++i;
+    }
+    for (const std::string &file : changed) {
+      std::error_code ec;
+      if (!index_of.count(file) && IsFileOfInterest(file) &&
+          fs::is_regular_file(file, ec)) {
+        index_of[file] = files_of_interest_.size();
+        files_of_interest_.emplace_back(file, 0);
+        needs_refresh_.push_back(false);
+        result_keys_.emplace_back();
+      }
+    }
+
+    std::vector<size_t> affected;
+    for (auto it = changed_files.rbegin(); it != changed_files.rend(); ++it) {
+      const auto found = index_of.find(it->lexically_normal().string());
+      if (found != index_of.end() &&
+          std::find(affected.begin(), affected.end(), found->second) ==
+              affected.end()) {
+        affected.push_back(found->second);
+      }
+    }
+    for (const std::string &file : dependents) {
+      const auto found = index_of.find(file);
+      if (found != index_of.end() && !changed.count(file)) {
+        affected.push_back(found->second);
+      }
+    }
+    // A changed configuration applies to all files below it.
+    for (size_t i = 0; i < files_of_interest_.size(); ++i) {
+      const std::string file = files_of_interest_[i].first.string();
+      for (const std::string &dir : changed_config_dirs) {
+        if (file.rfind(dir, 0) == 0 && !changed.count(file) &&
+            !dependents.count(file)) {
+          affected.push_back(i);
+          break;
+        }
+      }
+    }
+    Tracer::Get().files_considered += affected.size();
+    ParallelFor(affected.size(), GetJobCount(),
+                [&](size_t i) { Evaluate(affected[i], min_freshness); });
+
+    std::list<filepath_contenthash_t> work_queue;
+    for (const size_t i : affected) {
+      if (needs_refresh_[i]) {
+        work_queue.emplace_back(files_of_interest_[i]);
+      }
+    }
+    return work_queue;
+  }
+
+  // If a directory is excluded, all files in it are.
+  bool IsExcludedDir(const fs::path &dir) const {
+    static const std::regex exclude_re(std::string{kConfig.file_exclude_re});
+    return !kConfig.file_exclude_re.empty() &&
+           std::regex_search(dir.lexically_normal().string() + "/",
+                             exclude_re);
+  }
+
+  // Start the detailed report with the results of all files of interest not
+  // in the work list and point "symlink_detail" to it. Results of the work
+  // list are to be appended as they come in; the report is replaced by
+  // CreateReport() in the end. Returns nullptr if there is nothing to wait
+  // for or the report can't be written.
+  std::unique_ptr<LiveReport> StartLiveReport(
+      const fs::path &cache_dir, std::string_view variant,
+      std::string_view symlink_detail,
+      const std::list<filepath_contenthash_t> &work_list) const {
+    if (work_list.empty()) {
+      return nullptr;
+    }
+    const std::string suffix = ReportSuffix(variant);
+    const fs::path tidy_outfile = cache_dir / ("tidy.out-" + suffix);
+    const fs::path live_outfile = cache_dir / ("tidy.out-" + suffix + ".live");
+
+    std::unordered_set<std::string> pending;
+    for (const filepath_contenthash_t &work : work_list) {
+      pending.insert(work.first.string());
+    }
+    ReportAggregate previous(cache_dir / ("report-index-" + suffix));
+    previous.Load(tidy_outfile);
+    std::vector<ReportSection> sections;
+    for (size_t i = 0; i < files_of_interest_.size(); ++i) {
+      const filepath_contenthash_t &f = files_of_interest_[i];
+      const std::string file = f.first.string();
+      if (pending.count(file)) {
+        continue;
+      }
+      const std::optional<ReportAggregate::FileEntry> entry =
+          previous.Take(file);
+      const std::optional<filepath_contenthash_t> result_key =
+          needs_refresh_[i] ? dependencies_.ResultKey(f) : result_keys_[i];
+      if (entry && !needs_refresh_[i] && result_key &&
+          entry->result_hash == result_key->second) {
+        sections.push_back({entry->offset, entry->length, {}});
+        continue;
+      }
+      const auto content =
+          result_key ? store_.Lookup(*result_key) : std::nullopt;
+      if (content && !content->empty()) {
+        ReportSection section;
+        section.content.append(file).append(":\n").append(*content);
+        sections.push_back(std::move(section));
+      }
+    }
+    if (!WriteDetailReport(tidy_outfile, live_outfile, sections)) {
+      return nullptr;
+    }
+    auto result = std::make_unique<LiveReport>(live_outfile);
+    if (!result->ok()) {
+      return nullptr;
+    }
+    std::error_code ignored_error;
+    fs::remove(symlink_detail, ignored_error);
+    fs::create_symlink(live_outfile, symlink_detail, ignored_error);
+    return result;
+  }
+
+  // Tally up findings for files of interest and assemble in one file.
+  // (BuildWorkList() needs to be called first).
+  // The aggregate of the previous report is kept, so only files that have
+  // been processed in this run or whose results changed need to be read.
+  // Reports with a different "variant" name (e.g. for only a subset of
+  // files) are kept independently.
+  size_t CreateReport(const fs::path &cache_dir, std::string_view variant,
+                      std::string_view symlink_detail,
+                      std::string_view symlink_summary) const {
+    const std::string suffix = ReportSuffix(variant);
+    const fs::path tidy_outfile = cache_dir / ("tidy.out-" + suffix);
+    const fs::path tidy_summary = cache_dir / ("tidy-summary.out-" + suffix);
+
+    ReportAggregate previous(cache_dir / ("report-index-" + suffix));
+    ReportAggregate current(cache_dir / ("report-index-" + suffix));
+    std::map<std::string, int> checks_seen;
+    if (previous.Load(tidy_outfile)) {
+      for (const auto &[file, entry] : previous.entries()) {
+        AddCounts(entry.checks, 1, &checks_seen);
+      }
+    }
+
+    std::vector<ReportSection> sections;
+    bool report_changed = false;
+    uint64_t offset = 0;
+    for (size_t i = 0; i < files_of_interest_.size(); ++i) {
+      const filepath_contenthash_t &f = files_of_interest_[i];
+      const std::string file = f.first.string();
+      std::optional<ReportAggregate::FileEntry> entry = previous.Take(file);
+      const std::optional<filepath_contenthash_t> result_key =
+          needs_refresh_[i] ? dependencies_.ResultKey(f) : result_keys_[i];
+      if (entry && !needs_refresh_[i] && result_key &&
+          entry->result_hash == result_key->second) {
+        // Unchanged: reuse.
+        report_changed |= (entry->offset != offset);
+        sections.push_back({entry->offset, entry->length, {}});
+        entry->offset = offset;
+        offset += entry->length;
+        current.Add(file, std::move(*entry));
+        continue;
+      }
+      report_changed = true;
+      if (entry) {
+        AddCounts(entry->checks, -1, &checks_seen);
+      }
+      const auto content =
+          result_key ? store_.Lookup(*result_key) : std::nullopt;
+      if (!content) {
+        continue;  // Interrupted before we got to it.
+      }
+      ReportAggregate::FileEntry new_entry;
+      new_entry.result_hash = result_key->second;
+      new_entry.offset = offset;
+      new_entry.checks = CountChecks(*content);
+      AddCounts(new_entry.checks, 1, &checks_seen);
+      if (!content->empty()) {
+        ReportSection section;
+        section.content.append(file).append(":\n").append(*content);
+        new_entry.length = section.content.size();
+        offset += new_entry.length;
+        sections.push_back(std::move(section));
+      }
+      current.Add(file, std::move(new_entry));
+    }
+    for (const auto &[file, entry] : previous.entries()) {
+      report_changed = true;  // Files no longer of interest.
+      AddCounts(entry.checks, -1, &checks_seen);
+    }
+
+    if (report_changed) {
+      WriteDetailReport(tidy_outfile, tidy_outfile, sections);
+      current.Save();
+    }
+    std::error_code ignored_error;
+    fs::remove(symlink_detail, ignored_error);
+    fs::create_symlink(tidy_outfile, symlink_detail, ignored_error);
+
+    // Report headline.
+    if (checks_seen.empty()) {
+      std::cerr << "No clang-tidy complaints. 😎\n";
+    } else {
+      std::cerr << "Details: " << symlink_detail << "\n"
+                << "Summary: " << symlink_summary << "\n";
+      std::cerr << "---- Summary ----\n";
+    }
+
+    // Produce a ordered-by-count report.
+    using check_count_t = std::pair<std::string, int>;
+    std::vector<check_count_t> by_count(checks_seen.begin(), checks_seen.end());
+    std::stable_sort(by_count.begin(), by_count.end(),
+                     [](const check_count_t &a, const check_count_t &b) {
+                       return b.second < a.second;  // reverse count
+                     });
+
+    FILE *summary_file = fopen(tidy_summary.c_str(), "wb");
+    for (const auto &counts : by_count) {
+      fprintf(stdout, "%5d %s\n", counts.second, counts.first.c_str());
+      fprintf(summary_file, "%5d %s\n", counts.second, counts.first.c_str());
+    }
+    fclose(summary_file);
+
+    fs::remove(symlink_summary, ignored_error);
+    fs::create_symlink(tidy_summary, symlink_summary, ignored_error);
+
+    return checks_seen.size();
+  }
+
+  // With kConfig.files_from_compilation_db, headers are not processed on
+  // their own. Take them out of the work list and remember them to be served
+  // with ServeDivertedHeaders(). Translation units including them are added
+  // if their findings in headers are not known, e.g. as they stem from
+  // another cache.
+  void DivertHeaders(std::list<filepath_contenthash_t> *work_list) {
+    std::unordered_set<std::string> queued;
+    for (auto it = work_list->begin(); it != work_list->end();) {
+      if (IsIncludeExtension(it->first.extension().string())) {
+        diverted_headers_.push_back(it->first.string());
+        it = work_list->erase(it);
+      } else {
+        queued.insert(it->first.string());
+        ++it;
+      }
+    }
+    if (diverted_headers_.empty()) {
+      return;
+    }
+    const std::unordered_map<std::string, size_t> owners = HeaderOwners();
+    for (const std::string &header : diverted_headers_) {
+      const auto owner = owners.find(header);
+      if (owner == owners.end()) {
+        continue;
+      }
+      const filepath_contenthash_t &unit = files_of_interest_[owner->second];
+      const auto result_key = dependencies_.ResultKey(unit);
+      if (result_key && queued.insert(unit.first.string()).second &&
+          !store_.Lookup(*result_key,
+                         ClangTidyRunner::kHeaderFindingsSuffix)) {
+        work_list->push_back(unit);
+      }
+    }
+  }
+
+  // Store results for the headers taken out with DivertHeaders(): the
+  // findings for them in the run of the first translation unit including
+  // them. They depend on what that translation unit and its headers look
+  // like, so are revisited if any of these change.
+  void ServeDivertedHeaders() {
+    if (diverted_headers_.empty()) {
+      return;
+    }
+    const std::unordered_map<std::string, size_t> owners = HeaderOwners();
+    std::unordered_map<std::string, hash_t> hash_of;
+    for (const filepath_contenthash_t &f : files_of_interest_) {
+      hash_of[f.first.string()] = f.second;
+    }
+    size_t served = 0;
+    for (const std::string &header : diverted_headers_) {
+      const auto owner = owners.find(header);
+      if (owner == owners.end()) {
+        continue;
+      }
+      const filepath_contenthash_t &unit = files_of_interest_[owner->second];
+      const auto unit_key = dependencies_.ResultKey(unit);
+      const auto findings =
+          unit_key ? store_.Lookup(*unit_key,
+                                   ClangTidyRunner::kHeaderFindingsSuffix)
+                   : std::nullopt;
+      if (!findings) {
+        continue;  // Interrupted before we got to it.
+      }
+      std::vector<fs::path> depends_on =
+          dependencies_.Headers(unit).value_or(std::vector<fs::path>{});
+      depends_on.push_back(unit.first);
+      const filepath_contenthash_t result_key =
+          dependencies_.Record({header, hash_of[header]}, depends_on);
+      std::string result;
+      FilterCheckLines(fs::path(header).filename().string(), *findings,
+                       &result);
+      store_.Store(result_key, result);
+      ++served;
+    }
+    if (served > 0) {
+      std::cerr << served << " headers checked through translation units "
+                << "including them.\n";
+    }
+    if (served < diverted_headers_.size()) {
+      std::cerr << diverted_headers_.size() - served << " headers not "
+                << "included by any translation unit are not checked.\n";
+    }
+    diverted_headers_.clear();
+  }
+
+  // Add files with findings to the work list for which no fixes have been
+  // exported, e.g. as their result is from a run without --fix.
+  // (BuildWorkList() needs to be called first).
+  void AddFilesWithoutFixes(std::list<filepath_contenthash_t> *work_list) {
+    std::unordered_set<std::string> queued;
+    for (const filepath_contenthash_t &work : *work_list) {
+      queued.insert(work.first.string());
+    }
+    for (size_t i = 0; i < files_of_interest_.size(); ++i) {
+      const filepath_contenthash_t &f = files_of_interest_[i];
+      const std::optional<filepath_contenthash_t> result_key =
+          needs_refresh_[i] ? dependencies_.ResultKey(f) : result_keys_[i];
+      if (!result_key || queued.count(f.first.string()) ||
+          store_.Lookup(*result_key, ClangTidyRunner::kFixesSuffix)) {
+        continue;
+      }
+      const auto content = store_.Lookup(*result_key);
+      if (content && !content->empty()) {
+        work_list->push_back(f);
+      }
+    }
+  }
+
+  // Add the fixes exported for files of interest to "fixes". Like with
+  // clang-tidy, fixes of files with compiler errors are only added if
+  // "with_errors" is set, fixes from notes if "with_notes" is set.
+  // (BuildWorkList() needs to be called first).
+  void CollectFixes(bool with_notes, bool with_errors,
+                    FixApplier *fixes) const {
+    for (size_t i = 0; i < files_of_interest_.size(); ++i) {
+      const filepath_contenthash_t &f = files_of_interest_[i];
+      const std::optional<filepath_contenthash_t> result_key =
+          needs_refresh_[i] ? dependencies_.ResultKey(f) : result_keys_[i];
+      const auto content =
+          result_key ? store_.Lookup(*result_key) : std::nullopt;
+      if (!content || content->empty() ||
+          (!with_errors &&
+           content->find("[clang-diagnostic-error]") != std::string::npos)) {
+        continue;
+      }
+      const auto serialized =
+          store_.Lookup(*result_key, ClangTidyRunner::kFixesSuffix);
+      if (const auto file_fixes =
+              serialized ? DeserializeFixes(*serialized) : std::nullopt) {
+        fixes->Add(*file_fixes, with_notes);
+      }
+    }
+  }
+
+  // Write results of all files of interest to "export_file", so that they
+  // can be merged into the cache on another machine with ImportResults().
+  // (BuildWorkList() needs to be called first).
+  // Per file, there is a line
+  //   <key-hash> <result-hash> <seconds> <max-rss-kb> <#headers> <size> <path>
+  // followed by the headers it included, one per line, and the result.
+  bool ExportResults(const fs::path &export_file,
+                     const FileHistory &history) const {
+    const std::string tmp_file =
+        export_file.string() + "." + std::to_string(getpid()) + ".tmp";
+    FILE *out = fopen(tmp_file.c_str(), "wb");
+    if (!out) {
+      return false;
+    }
+    for (size_t i = 0; i < files_of_interest_.size(); ++i) {
+      const filepath_contenthash_t &f = files_of_interest_[i];
+      const std::optional<filepath_contenthash_t> result_key =
+          needs_refresh_[i] ? dependencies_.ResultKey(f) : result_keys_[i];
+      const auto content =
+          result_key ? store_.Lookup(*result_key) : std::nullopt;
+      if (!content) {
+        continue;  // Interrupted before we got to it.
+      }
+      const std::vector<fs::path> headers =
+          dependencies_.Headers(f).value_or(std::vector<fs::path>{});
+      fprintf(out, "%s %s %.3f %" PRIu64 " %zu %zu %s\n",
+              ToHex(f.second).c_str(), ToHex(result_key->second).c_str(),
+              history.Duration(f.first).value_or(-1),
+              history.MaxRss(f.first).value_or(0), headers.size(),
+              content->size(), f.first.c_str());
+      for (const fs::path &header : headers) {
+        fprintf(out, "%s\n", header.c_str());
+      }
+      fwrite(content->data(), 1, content->size(), out);
+    }
+    if (fclose(out) != 0) {
+      return false;
+    }
+    std::error_code ec;
+    fs::rename(tmp_file, export_file, ec);  // atomic replacement
+    return !ec;
+  }
+
+  // Import results written with ExportResults() into the store and history.
+  // Results for files whose headers differ from what we have here are
+  // skipped. Returns number of results imported or empty optional if the
+  // file could not be read.
+  static std::optional<size_t> ImportResults(
+      const fs::path &export_file, ContentAddressedStore &store,
+      const DependencyTracker &dependencies, FileHistory *history) {
+    FILE *in = fopen(export_file.string().c_str(), "rb");
+    if (!in) {
+      return std::nullopt;
+    }
+    size_t imported = 0;
+    char line[8192];
+    while (fgets(line, sizeof(line), in)) {
+      hash_t key_hash = 0;
+      hash_t result_hash = 0;
+      double seconds = -1;
+      uint64_t max_rss_kb = 0;
+      size_t header_count = 0;
+      size_t size = 0;
+      int path_start = 0;
+      if (sscanf(line, "%" SCNx64 " %" SCNx64 " %lf %" SCNu64 " %zu %zu %n",
+                 &key_hash, &result_hash, &seconds, &max_rss_kb,
+                 &header_count, &size, &path_start) < 6 ||
+          path_start == 0) {
+        break;  // Out of sync; can't continue.
+      }
+      std::string file(line + path_start);
+      if (!file.empty() && file.back() == '\n') {
+        file.pop_back();
+      }
+      std::vector<fs::path> headers;
+      while (headers.size() < header_count && fgets(line, sizeof(line), in)) {
+        std::string header(line);
+        if (!header.empty() && header.back() == '\n') {
+          header.pop_back();
+        }
+        headers.emplace_back(header);
+      }
+      std::string content(size, '\0');
+      if (fread(content.data(), 1, size, in) != size) {
+        break;
+      }
+      const filepath_contenthash_t result_key =
+          dependencies.Record({file, key_hash}, headers);
+      if (result_key.second != result_hash) {
+        continue;  // Different headers here.
+      }
+      store.Store(result_key, content);
+      if (seconds >= 0) {
+        history->Record(file, seconds, max_rss_kb, !content.empty());
+      }
+      ++imported;
+    }
+    fclose(in);
+    return imported;
+  }
+
+ private:
+  // Create content hash address for the cache and determine if the file
+  // needs to be processed.
+  // The address also depends on the compile command used for the file.
+  // If we want to revisit if headers changed, the result key depends on
+  // the content of all headers seen in the last run.
+  void Evaluate(size_t i, file_time min_freshness) {
+    filepath_contenthash_t &work_file = files_of_interest_[i];
+    work_file.second =
+        KeyHash(work_file.first, hasher_.HashOf(work_file.first));
+    // Recreate if we don't have it yet or if it contains findings but is
+    // older than build environment. Maybe something got fixed: revisit file.
+    result_keys_[i] = dependencies_.ResultKey(work_file);
+    needs_refresh_[i] = !result_keys_[i] ||
+                        store_.NeedsRefresh(*result_keys_[i], min_freshness);
+  }
+
+  // Key of a file with the given content hash: also depends on the compile
+  // command and configuration used.
+  hash_t KeyHash(const fs::path &file, hash_t content_hash) const {
+    return content_hash ^ compilation_db_.FingerprintOf(file) ^
+           config_chain_.HashOf(file);
+  }
+
+  // Walk the directory tree, not descending into excluded directories.
+  void WalkFiles() {
+    std::error_code ec;
+    for (auto it = fs::recursive_directory_iterator(root_dir_, ec);
+         it != fs::recursive_directory_iterator(); it.increment(ec)) {
+      if (it->is_directory(ec)) {
+        if (IsExcludedDir(it->path())) {
+          it.disable_recursion_pending();
+        }
+        continue;
+      }
+      if (!it->is_regular_file(ec)) {
+        continue;
+      }
+      const fs::path &p = it->path().lexically_normal();
+      if (IsFileOfInterest(p)) {
+        files_of_interest_.emplace_back(p, 0);  // <- hash to be filled later.
+      }
+    }
+  }
+
+  // Use the files git knows about below the search dir: tracked files and
+  // untracked files that are not ignored. Returns false if git fails.
+  bool FindFilesWithGit() {
+    std::string listed;
+    if (RunProcess({"git", "ls-files", "-z", "--cached", "--others",
+                    "--exclude-standard", "--", root_dir_},
+                   &listed) != 0) {
+      std::cerr << "Could not list files with git; walking the tree.\n";
+      return false;
+    }
+    std::unordered_set<std::string_view> seen;  // Unmerged files repeat.
+    std::string_view names = listed;
+    while (!names.empty()) {
+      const size_t end = std::min(names.find('\0'), names.size());
+      const std::string_view name = names.substr(0, end);
+      names.remove_prefix(std::min(end + 1, names.size()));
+      if (name.empty() || !seen.insert(name).second) {
+        continue;
+      }
+      const fs::path p = fs::path(name).lexically_normal();
+      std::error_code ec;
+      if (IsFileOfInterest(p) && fs::is_regular_file(p, ec)) {
+        files_of_interest_.emplace_back(p, 0);
+      }
+    }
+    return true;
+  }
+
+  bool IsFileOfInterest(const fs::path &p) const {
+    static const std::regex include_re(std::string{kConfig.file_include_re});
+    static const std::regex exclude_re(std::string{kConfig.file_exclude_re});
+    if (!ConsiderExtension(p.extension().string())) {
+      return false;  // Cheapest test first.
+    }
+    if (kConfig.files_from_compilation_db &&
+        !IsIncludeExtension(p.extension().string()) &&
+        !compilation_db_.Contains(p)) {
+      return false;
+    }
+    const std::string file = p.string();
+    if (root_dir_ != "." && !p.lexically_relative(root_dir_).empty() &&
+        p.lexically_relative(root_dir_).string().rfind("..", 0) == 0) {
+      return false;  // Outside of search dir.
+    }
+    if (!kConfig.file_include_re.empty() &&
+        !std::regex_search(file, include_re)) {
+      return false;
+    }
+    return kConfig.file_exclude_re.empty() ||
+           !std::regex_search(file, exclude_re);
+  }
+
+  // For each header, the index of the translation unit that owns it: the
+  // first one in path order that included it in its last run.
+  std::unordered_map<std::string, size_t> HeaderOwners() const {
+    std::vector<size_t> units;
+    for (size_t i = 0; i < files_of_interest_.size(); ++i) {
+      const fs::path &file = files_of_interest_[i].first;
+      if (!IsIncludeExtension(file.extension().string())) {
+        units.push_back(i);
+      }
+    }
+    std::sort(units.begin(), units.end(), [&](size_t a, size_t b) {
+      return files_of_interest_[a].first < files_of_interest_[b].first;
+    });
+    std::vector<std::optional<std::vector<fs::path>>> headers(units.size());
+    ParallelFor(units.size(), GetJobCount(), [&](size_t i) {
+      headers[i] = dependencies_.Headers(files_of_interest_[units[i]]);
+    });
+    std::unordered_map<std::string, size_t> result;
+    for (size_t i = 0; i < units.size(); ++i) {
+      for (const fs::path &header : headers[i].value_or(
+               std::vector<fs::path>{})) {
+        result.emplace(header.string(), units[i]);
+      }
+    }
+    return result;
+  }
+
+  // Candidates that included any of the given files in their last
+  // clang-tidy run. Candidates are files with their content hash (without
+  // compile command fingerprint) or the full key if "is_key" is set.
+  std::vector<fs::path> FindDependents(
+      const std::unordered_set<std::string> &files,
+      const std::vector<filepath_contenthash_t> &candidates,
+      bool is_key = true) const {
+    std::vector<char> is_dependent(candidates.size());
+    ParallelFor(candidates.size(), GetJobCount(), [&](size_t i) {
+      const fs::path &file = candidates[i].first;
+      const filepath_contenthash_t key{
+          file, is_key ? candidates[i].second
+                       : KeyHash(file, candidates[i].second)};
+      const auto headers = dependencies_.Headers(key);
+      is_dependent[i] =
+          headers && std::any_of(headers->begin(), headers->end(),
+                                 [&](const fs::path &header) {
+                                   return files.count(header.string()) > 0;
+                                 });
+    });
+    std::vector<fs::path> result;
+    for (size_t i = 0; i < candidates.size(); ++i) {
+      if (is_dependent[i]) {
+        result.push_back(candidates[i].first);
+      }
+    }
+    return result;
+  }
+
+  static std::unordered_map<std::string, double> ReadShardWeights(
+      const fs::path &weights_file) {
+    std::unordered_map<std::string, double> result;
+    FILE *in = fopen(weights_file.string().c_str(), "rb");
+    if (!in) {
+      std::cerr << "Could not read " << weights_file
+                << "; balancing by number of files.\n";
+      return result;
+    }
+    char line[4096];
+    while (fgets(line, sizeof(line), in)) {
+      double seconds;
+      int path_start = 0;
+      if (sscanf(line, "%lf %n", &seconds, &path_start) < 1 ||
+          path_start == 0) {
+        continue;
+      }
+      std::string file(line + path_start);
+      if (!file.empty() && file.back() == '\n') {
+        file.pop_back();
+      }
+      result[file] = seconds;
+    }
+    fclose(in);
+    return result;
+  }
+
+  static void AddCounts(const std::map<std::string, int> &counts, int sign,
+                        std::map<std::string, int> *totals) {
+    for (const auto &[check, count] : counts) {
+      const int total = ((*totals)[check] += sign * count);
+      if (total <= 0) {
+        totals->erase(check);
+      }
+    }
+  }
+
+  // Section of the detailed report: either new content or a range to be
+  // copied from the previous version of the report.
+  struct ReportSection {
+    uint64_t old_offset = 0;
+    uint64_t old_length = 0;
+    std::string content;
+  };
+
+  // Make it possible to keep independent reports for different invocation
+  // locations (e.g. two checkouts of the same project) using the same cache.
+  static std::string ReportSuffix(std::string_view variant) {
+    return ToHex(hashContent(fs::current_path().string())) +
+           std::string(variant);
+  }
+
+  // Write "report" from the sections; old ranges are copied from
+  // "old_report" (which might be the same file).
+  static bool WriteDetailReport(const fs::path &old_report_file,
+                                const fs::path &report,
+                                const std::vector<ReportSection> &sections) {
+    const int old_report =
+        open(old_report_file.c_str(), O_RDONLY | O_CLOEXEC);
+    const std::string tmp_file =
+        report.string() + "." + std::to_string(getpid()) + ".tmp";
+    FILE *out = fopen(tmp_file.c_str(), "wb");
+    char buffer[65536];
+    for (const ReportSection &section : sections) {
+      if (!out) {
+        break;
+      }
+      fwrite(section.content.data(), 1, section.content.size(), out);
+      for (uint64_t pos = 0; pos < section.old_length;) {
+        const ssize_t r =
+            pread(old_report, buffer,
+                  std::min<uint64_t>(sizeof(buffer), section.old_length - pos),
+                  section.old_offset + pos);
+        if (r <= 0) {
+          fclose(out);  // Report changed underneath us. Bail out.
+          out = nullptr;
+          break;
+        }
+        fwrite(buffer, 1, r, out);
+        pos += r;
+      }
+    }
+    if (old_report >= 0) {
+      close(old_report);
+    }
+    if (out && fclose(out) == 0) {
+      fs::rename(tmp_file, report);  // atomic replacement
+      return true;
+    }
+    unlink(tmp_file.c_str());
+    return false;
+  }
+
+  ContentAddressedStore &store_;
+  ContentHasher &hasher_;
+  const DependencyTracker &dependencies_;
+  const CompilationDatabase &compilation_db_;
+  const std::string root_dir_;
+  mutable ConfigChain config_chain_;
+  std::vector<filepath_contenthash_t> files_of_interest_;
+  std::vector<char> needs_refresh_;
+  std::vector<std::optional<filepath_contenthash_t>> result_keys_;
+  std::vector<std::string> diverted_headers_;
+  bool found_all_files_ = false;  // With FindFiles() instead of UseFiles().
+};
+
+// Results of the work items in another cache with different checks,
+// filtered with "filter". Work items found are moved to "found".
+std::unordered_map<std::string, std::string> FilteredResultsOf(
+    const ContentAddressedStore &other_store,
+    const DependencyTracker &other_dependencies,
+    const CheckSubsetFilter &filter, file_time min_freshness,
+    std::list<filepath_contenthash_t> *work_list,
+    std::list<filepath_contenthash_t> *found) {
+  const std::vector<filepath_contenthash_t> work(work_list->begin(),
+                                                 work_list->end());
+  std::vector<std::optional<std::string>> results(work.size());
+  ParallelFor(work.size(), GetJobCount(), [&](size_t i) {
+    const auto other_key = other_dependencies.ResultKey(work[i]);
+    if (!other_key || other_store.NeedsRefresh(*other_key, min_freshness)) {
+      return;
+    }
+    if (const auto content = other_store.Lookup(*other_key)) {
+      results[i] = filter.Apply(*content);
+    }
+  });
+  std::unordered_map<std::string, std::string> result;
+  work_list->clear();
+  for (size_t i = 0; i < work.size(); ++i) {
+    if (results[i]) {
+      result[work[i].first.string()] = std::move(*results[i]);
+      found->push_back(work[i]);
+    } else {
+      work_list->push_back(work[i]);
+    }
+  }
+  return result;
+}
+
+// Serve work from the results of a run with more checks, filtered down to
+// the checks we are interested in. Served files are removed from the work
+// list, their results stored in "store". Returns number of files served.
+size_t ServeFromRunWithMoreChecks(
+    const ContentAddressedStore &full_store,
+    const DependencyTracker &full_dependencies,
+    const CheckSubsetFilter &filter, ContentAddressedStore &store,
+    const DependencyTracker &dependencies, file_time min_freshness,
+    std::list<filepath_contenthash_t> *work_list) {
+  std::list<filepath_contenthash_t> served;
+  const auto results = FilteredResultsOf(full_store, full_dependencies, filter,
+                                         min_freshness, work_list, &served);
+  for (const filepath_contenthash_t &work : served) {
+    const auto headers = full_dependencies.Headers(work);
+    const filepath_contenthash_t result_key =
+        dependencies.Record(work, headers.value_or(std::vector<fs::path>{}));
+    store.Store(result_key, results.at(work.first.string()));
+  }
+  return served.size();
+}
+
+// Files changed relative to the merge base of "rev" and HEAD, including
+// uncommitted and untracked files. Deleted files, and the old name of
+// renamed ones, are included as well, as files that included them need to
+// be looked at. Paths are relative to the current directory. Returns an
+// empty optional if git fails.
+std::optional<std::vector<fs::path>> GitChangedFilesSince(
+    const std::string &rev) {
+  std::string merge_base;
+  if (RunProcess({"git", "merge-base", rev, "HEAD"}, &merge_base) != 0) {
+    return std::nullopt;
+  }
+  while (!merge_base.empty() && isspace(merge_base.back())) {
+    merge_base.pop_back();
+  }
+  std::string changed;
+  std::string untracked;
+  if (RunProcess({"git", "diff", "-z", "--name-only", "--relative",
+                  "--no-renames", merge_base},
+                 &changed) != 0 ||
+      RunProcess({"git", "ls-files", "-z", "--others", "--exclude-standard"},
+                 &untracked) != 0) {
+    return std::nullopt;
+  }
+  std::vector<fs::path> result;
+  for (std::string_view names : {changed, untracked}) {
+    while (!names.empty()) {
+      const size_t end = std::min(names.find('\0'), names.size());
+      if (end > 0) {
+        result.emplace_back(names.substr(0, end));
+      }
+      names.remove_prefix(std::min(end + 1, names.size()));
+    }
+  }
+  return result;
+}
+
+#ifdef __linux__
+// Watch a directory tree for files being written, moved or deleted.
+class TreeWatcher {
+ public:
+  // Directories for which "is_excluded" returns true are not watched. Only
+  // changes to files for which "consider_file" returns true are reported.
+  TreeWatcher(const fs::path &root,
+              std::function<bool(const fs::path &)> is_excluded,
+              std::function<bool(const fs::path &)> consider_file)
+      : fd_(inotify_init1(IN_CLOEXEC)),
+        is_excluded_(std::move(is_excluded)),
+        consider_file_(std::move(consider_file)) {
+    AddWatches(root.empty() ? "." : root);
+  }
+
+  ~TreeWatcher() { close(fd_); }
+
+  bool ok() const { return fd_ >= 0; }
+
+  // Block until files changed. Returns the changed files in the order they
+  // changed the last time. Waits until changes settle, as editors and
+  // tools often do a sequence of operations when saving. Returns an empty
+  // optional if changes got lost as there were too many at once.
+  std::optional<std::vector<fs::path>> WaitForChanges() {
+    std::vector<fs::path> result;
+    std::unordered_map<std::string, size_t> position;
+    bool overflow = false;
+    // Wait for first change, then wait for things to settle.
+    struct pollfd fds = {fd_, POLLIN, 0};
+    while (poll(&fds, 1, result.empty() ? -1 : 100) > 0) {
+      alignas(struct inotify_event) char buffer[65536];
+      const ssize_t len = read(fd_, buffer, sizeof(buffer));
+      for (ssize_t pos = 0; pos < len;) {
+        const auto *event = reinterpret_cast<struct inotify_event *>(
+            buffer + pos);
+        pos += sizeof(struct inotify_event) + event->len;
+        if (event->mask & IN_Q_OVERFLOW) {
+          overflow = true;
+          continue;
+        }
+        const auto dir = watched_dirs_.find(event->wd);
+        if (dir == watched_dirs_.end() || event->len == 0) {
+          continue;
+        }
+        const fs::path path = dir->second / event->name;
+        if (event->mask & IN_ISDIR) {
+          if (event->mask & (IN_CREATE | IN_MOVED_TO)) {
+            AddWatches(path);
+          }
+          continue;
+        }
+        if (!consider_file_(path)) {
+          continue;
+        }
+        const auto found = position.find(path.string());
+        if (found != position.end()) {
+          result[found->second].clear();  // Re-added below as most recent.
+        }
+        position[path.string()] = result.size();
+        result.push_back(path);
+      }
+    }
+    if (overflow) {
+      return std::nullopt;
+    }
+    result.erase(std::remove(result.begin(), result.end(), fs::path()),
+                 result.end());
+    return result;
+  }
+
+ private:
+  void AddWatches(const fs::path &dir) {
+    if (is_excluded_(dir)) {
+      return;
+    }
+    const int wd = inotify_add_watch(
+        fd_, dir.c_str(),
+        IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_DELETE | IN_CREATE |
+            IN_ONLYDIR);
+    if (wd < 0) {
+      return;
+    }
+    watched_dirs_[wd] = dir;
+    std::error_code ec;
+    for (const auto &entry : fs::directory_iterator(dir, ec)) {
+      if (entry.is_directory(ec) && !entry.is_symlink(ec)) {
+        AddWatches(entry.path().lexically_normal());
+      }
+    }
+  }
+
+  const int fd_;
+  const std::function<bool(const fs::path &)> is_excluded_;
+  const std::function<bool(const fs::path &)> consider_file_;
+  std::unordered_map<int, fs::path> watched_dirs_;
+};
+#endif
+
+// Lock signifying that an invocation uses a project cache directory; shared
+// between concurrent invocations, exclusive for the garbage collector.
+// The modification time of the lock file is the last use of the directory.
+class ProjectCacheLock {
+ public:
+  explicit ProjectCacheLock(const fs::path &project_cache_dir) {
+    for (;;) {
+      fs::create_directories(project_cache_dir);
+      fd_ = open((project_cache_dir / kLockFile).c_str(),
+                 O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+      if (fd_ < 0) {
+        return;  // Best effort.
+      }
+      flock(fd_, LOCK_SH);
+      struct stat st;
+      if (fstat(fd_, &st) == 0 && st.st_nlink > 0) {
+        break;
+      }
+      close(fd_);  // Garbage collected just now; start over.
+    }
+    futimens(fd_, nullptr);  // Mark as used now.
+  }
+
+  ~ProjectCacheLock() {
+    if (fd_ >= 0) {
+      close(fd_);
+    }
+  }
+
+  // Upgrade to an exclusive lock. Returns false if it is in use elsewhere;
+  // the shared lock is held again then. (Converting with flock() is not
+  // atomic and a failed attempt might leave no lock at all, so this is
+  // explicit.)
+  bool TryExclusive() {
+    if (fd_ < 0) {
+      return false;
+    }
+    flock(fd_, LOCK_UN);
+    if (flock(fd_, LOCK_EX | LOCK_NB) == 0) {
+      return true;
+    }
+    flock(fd_, LOCK_SH);
+    return false;
+  }
+
+  // Go back to a shared lock after TryExclusive(), so that other
+  // invocations can use the cache dir again.
+  void DowngradeToShared() {
+    if (fd_ >= 0) {
+      flock(fd_, LOCK_SH);
+    }
+  }
+
+  // Remove given project cache directory, unless it is in use.
+  static bool TryRemoveUnused(const fs::path &project_cache_dir) {
+    const int fd = open((project_cache_dir / kLockFile).c_str(),
+                        O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0 || flock(fd, LOCK_EX | LOCK_NB) != 0) {
+      if (fd >= 0) {
+        close(fd);
+      }
+      return false;
+    }
+    std::error_code ec;
+    fs::remove_all(project_cache_dir, ec);
+    close(fd);
+    return !ec;
+  }
+
+  // Last time the project cache directory was used.
+  static int64_t LastUse(const fs::path &project_cache_dir) {
+    struct stat st;
+    if (stat((project_cache_dir / kLockFile).c_str(), &st) == 0 ||
+        stat(project_cache_dir.c_str(), &st) == 0) {
+      return st.st_mtime;
+    }
+    return 0;
+  }
+
+ private:
+  static constexpr std::string_view kLockFile = "lock";
+  int fd_ = -1;
+};
+
+// Keep the cache within a disk budget: remove whole project cache dirs
+// (e.g. left behind by old clang-tidy versions or configurations), least
+// recently used first, then least recently used entries of the current one.
+// Configured with environment variables
+//   CACHE_MAX_SIZE      = maximum size of the whole cache, e.g. 2G or 500M.
+//   CACHE_MAX_AGE_DAYS  = remove everything not used in that many days.
+class CacheGarbageCollector {
+ public:
+  CacheGarbageCollector()
+      : max_size_(ParseSize(getenv("CACHE_MAX_SIZE"))),
+        max_age_seconds_(86400 * atoll(EnvWithFallback("CACHE_MAX_AGE_DAYS",
+                                                       "0").data())) {}
+
+  bool has_budget() const { return max_size_ > 0 || max_age_seconds_ > 0; }
+
+  // Garbage collection needs to walk through the whole cache, so only do it
+  // once a day automatically.
+  bool IsDue(const fs::path &current_dir) const {
+    std::error_code ec;
+    const auto last_run =
+        fs::last_write_time(current_dir.parent_path() / kLastRunMarker, ec);
+    return has_budget() &&
+           (ec || last_run < file_time::clock::now() - std::chrono::hours(24));
+  }
+
+  void Run(const fs::path &current_dir, ProjectCacheLock *current_lock,
+           ContentAddressedStore *current_store) const {
+    const fs::path cache_root = current_dir.parent_path();
+    const int64_t now = time(nullptr);
+    const int64_t oldest_allowed = max_age_seconds_ ? now - max_age_seconds_
+                                                    : 0;
+    struct DirUse {
+      fs::path dir;
+      int64_t last_use;
+      uint64_t size;
+    };
+    std::vector<DirUse> others;
+    uint64_t total = DiskUsage(current_dir);
+    std::error_code ec;
+    for (const auto &entry : fs::directory_iterator(cache_root, ec)) {
+      if (!entry.is_directory() || entry.path() == current_dir) {
+        continue;
+      }
+      others.push_back({entry.path(), ProjectCacheLock::LastUse(entry.path()),
+                        DiskUsage(entry.path())});
+      total += others.back().size;
+    }
+    auto over_budget = [&](int64_t last_use) {
+      return last_use < oldest_allowed || (max_size_ && total > max_size_);
+    };
+
+    std::stable_sort(others.begin(), others.end(),
+                     [](const DirUse &a, const DirUse &b) {
+                       return a.last_use < b.last_use;
+                     });
+    int removed_dirs = 0;
+    for (const DirUse &other : others) {
+      if (over_budget(other.last_use) &&
+          ProjectCacheLock::TryRemoveUnused(other.dir)) {
+        total -= other.size;
+        ++removed_dirs;
+      }
+    }
+
+    size_t removed_entries = 0;
+    if (current_lock->TryExclusive()) {
+      std::vector<ContentAddressedStore::EntryStat> entries =
+          current_store->ListEntries();
+      std::stable_sort(entries.begin(), entries.end(),
+                       [](const auto &a, const auto &b) {
+                         return a.last_access < b.last_access;
+                       });
+      std::unordered_set<std::string> evict;
+      for (const auto &entry : entries) {
+        if (!over_budget(entry.last_access)) {
+          break;
+        }
+        evict.insert(entry.key);
+        total -= std::min(total, entry.disk_size);
+      }
+      current_store->Remove(evict);
+      removed_entries = evict.size();
+      current_lock->DowngradeToShared();
+    } else {
+      std::cerr << "Cache dir in use by another invocation; not collecting "
+                << "its entries this time.\n";
+    }
+
+    FILE *marker = fopen((cache_root / kLastRunMarker).c_str(), "wb");
+    if (marker) {
+      fclose(marker);
+    }
+    fprintf(stderr,
+            "Cache garbage collection: removed %d cache dirs and %zu entries;"
+            " %.1f MiB in use.\n",
+            removed_dirs, removed_entries, total / (1024.0 * 1024));
+  }
+
+ private:
+  static constexpr std::string_view kLastRunMarker = "last-gc";
+
+  static uint64_t DiskUsage(const fs::path &dir) {
+    uint64_t result = 0;
+    std::error_code ec;
+    for (const auto &entry : fs::recursive_directory_iterator(dir, ec)) {
+      if (entry.is_regular_file(ec)) {
+        result += entry.file_size(ec);
+      }
+    }
+    return result;
+  }
+
+  const uint64_t max_size_;
+  const int64_t max_age_seconds_;
+};
+// The checks enabled and the configuration apart from them are kept in
+// each project cache dir, so that a new configuration only differing in the
+// checks can reuse the results of a previous one.
+class CacheDirChecks {
+ public:
+  CacheDirChecks(std::string configuration, std::vector<std::string> checks)
+      : configuration_(std::move(configuration)), checks_(std::move(checks)) {
+    std::sort(checks_.begin(), checks_.end());
+  }
+
+  static std::optional<CacheDirChecks> Load(const fs::path &cache_dir) {
+    std::error_code ec;
+    if (!fs::exists(cache_dir / kChecksFile, ec) ||
+        !fs::exists(cache_dir / kConfigurationFile, ec)) {
+      return std::nullopt;
+    }
+    std::vector<std::string> checks;
+    ForEachLine(GetContent(cache_dir / kChecksFile),
+                [&](std::string_view line, bool) {
+                  checks.emplace_back(line);
+                });
+    return CacheDirChecks(GetContent(cache_dir / kConfigurationFile),
+                          std::move(checks));
+  }
+
+  void Save(const fs::path &cache_dir) const {
+    std::string checks;
+    for (const std::string &check : checks_) {
+      checks.append(check).append(1, '\n');
+    }
+    WriteAtomically(cache_dir / kConfigurationFile, configuration_);
+    WriteAtomically(cache_dir / kChecksFile, checks);  // Last: marks done.
+  }
+
+  // The sibling of "cache_dir" with the same configuration apart from the
+  // checks that needs the fewest checks to run additionally. Fills in the
+  // checks added and removed relative to it.
+  std::optional<fs::path> FindSiblingWithOtherChecks(
+      const fs::path &cache_dir, std::vector<std::string> *added,
+      std::vector<std::string> *removed) const {
+    const std::string name = cache_dir.filename().string();
+    const std::string sibling_prefix = name.substr(0, name.rfind('_') + 1);
+    std::optional<fs::path> result;
+    int64_t result_last_use = 0;
+    std::error_code ec;
+    for (const auto &entry :
+         fs::directory_iterator(cache_dir.parent_path(), ec)) {
+      const fs::path &dir = entry.path();
+      if (dir == cache_dir ||
+          dir.filename().string().rfind(sibling_prefix, 0) != 0) {
+        continue;
+      }
+      const auto other = Load(dir);
+      if (!other || configuration_.empty()) {
+        continue;
+      }
+      std::vector<std::string> dir_added;
+      std::vector<std::string> dir_removed;
+      std::set_difference(checks_.begin(), checks_.end(),
+                          other->checks_.begin(), other->checks_.end(),
+                          std::back_inserter(dir_added));
+      std::set_difference(other->checks_.begin(), other->checks_.end(),
+                          checks_.begin(), checks_.end(),
+                          std::back_inserter(dir_removed));
+      if (dir_added.size() == checks_.size()) {
+        continue;  // Nothing in common.
+      }
+      // Options are dumped for each check enabled; only those of checks
+      // both run have to be the same.
+      std::vector<std::string> common;
+      std::set_intersection(checks_.begin(), checks_.end(),
+                            other->checks_.begin(), other->checks_.end(),
+                            std::back_inserter(common));
+      if (WithOptionsOf(configuration_, common) !=
+          WithOptionsOf(other->configuration_, common)) {
+        continue;
+      }
+      const int64_t last_use = ProjectCacheLock::LastUse(dir);
+      if (!result || dir_added.size() < added->size() ||
+          (dir_added.size() == added->size() && last_use > result_last_use)) {
+        result = dir;
+        result_last_use = last_use;
+        *added = std::move(dir_added);
+        *removed = std::move(dir_removed);
+      }
+    }
+    return result;
+  }
+
+  const std::vector<std::string> &checks() const { return checks_; }
+
+ private:
+  static constexpr std::string_view kConfigurationFile = "configuration";
+  static constexpr std::string_view kChecksFile = "enabled-checks";
+
+  // The "configuration" with only the CheckOptions of the sorted "checks";
+  // options not belonging to a check are kept. Handles both the list
+  // ("- key: check.Option" / "value: ...") and the map ("check.Option: ...")
+  // form, depending on the clang-tidy version.
+  static std::string WithOptionsOf(std::string_view configuration,
+                                   const std::vector<std::string> &checks) {
+    std::string result;
+    bool in_options = false;
+    size_t entry_indent = std::string_view::npos;
+    bool keep_entry = true;
+    ForEachLine(configuration, [&](std::string_view line, bool) {
+      if (!line.empty() && !isspace(line.front())) {
+        in_options = line.substr(0, 13) == "CheckOptions:";
+        entry_indent = std::string_view::npos;
+        keep_entry = true;
+      } else if (in_options) {
+        const size_t indent = line.find_first_not_of(' ');
+        if (entry_indent == std::string_view::npos) {
+          entry_indent = indent;
+        }
+        if (indent == entry_indent) {  // Start of the next option.
+          std::string_view key = line.substr(indent);
+          if (key.substr(0, 2) == "- ") {
+            key = key.substr(key.find_first_not_of(' ', 2));
+          }
+          if (key.substr(0, 4) == "key:") {
+            key = key.substr(4);
+            key = key.substr(std::min(key.size(), key.find_first_not_of(' ')));
+          } else {
+            key = key.substr(0, key.find(':'));
+          }
+          const size_t dot = key.rfind('.');
+          keep_entry =
+              dot == std::string_view::npos ||
+              std::binary_search(checks.begin(), checks.end(),
+                                 std::string(key.substr(0, dot)));
+        }
+      }
+      if (keep_entry) {
+        result.append(line).append(1, '\n');
+      }
+    });
+    return result;
+  }
+
+  static void WriteAtomically(const fs::path &file, std::string_view content) {
+    const std::string tmp_file =
+        file.string() + "." + std::to_string(getpid()) + ".tmp";
+    FILE *out = fopen(tmp_file.c_str(), "wb");
+    if (!out) {
+      return;  // Best effort.
+    }
+    fwrite(content.data(), 1, content.size(), out);
+    if (fclose(out) == 0) {
+      fs::rename(tmp_file, file);  // atomic replacement
+    }
+  }
+
+  std::string configuration_;
+  std::vector<std::string> checks_;
+};
+
+}  // namespace
+
+// Benchmarks include this file to access the internals.
+#ifndef RUN_CLANG_TIDY_CACHED_NO_MAIN
+int main(int argc, char *argv[]) {
+  Tracer &tracer = Tracer::Get();  // Starts the clock.
+  MaybeLowerPriority();
+
+  // Our own flags; everything else is passed to clang-tidy.
+  bool gc_only = false;
+  std::optional<std::string> since_rev;
+  bool include_dependents = false;
+  bool watch = false;
+  bool fix = false;
+  bool fix_errors = false;
+  bool fix_notes = false;
+  int shard_index = 0;
+  int shard_count = 0;
+  std::optional<fs::path> shard_weights;
+  std::vector<std::string> merge_files;
+  std::vector<std::string> clang_tidy_args;
+  for (int i = 1; i < argc; ++i) {
+    const std::string_view arg = argv[i];
+    if (arg == "--gc") {
+      gc_only = true;
+    } else if (arg.substr(0, 8) == "--since=") {
+      since_rev = std::string(arg.substr(8));
+    } else if (arg == "--include-dependents") {
+      include_dependents = true;
+    } else if (arg == "--watch") {
+      watch = true;
+    } else if (arg == "--fix" || arg == "-fix") {
+      fix = true;
+    } else if (arg == "--fix-errors" || arg == "-fix-errors") {
+      fix = fix_errors = true;
+    } else if (arg == "--fix-notes" || arg == "-fix-notes") {
+      fix = fix_notes = true;
+    } else if (arg.substr(0, 8) == "--shard=") {
+      if (sscanf(argv[i] + 8, "%d/%d", &shard_index, &shard_count) != 2 ||
+          shard_index < 1 || shard_index > shard_count) {
+        std::cerr << "Expected --shard=i/N with 1 <= i <= N\n";
+        return EXIT_FAILURE;
+      }
+    } else if (arg.substr(0, 16) == "--shard-weights=") {
+      shard_weights = arg.substr(16);
+    } else if (arg.substr(0, 8) == "--merge=") {
+      merge_files.emplace_back(arg.substr(8));
+    } else {
+      clang_tidy_args.emplace_back(arg);
+    }
+  }
+
+  if (fix && watch) {
+    std::cerr << "--fix can't be combined with --watch\n";
+    return EXIT_FAILURE;
+  }
+  if (kConfig.files_from_compilation_db &&
+      !kConfig.revisit_if_any_include_changes) {
+    std::cerr << "kConfig.files_from_compilation_db needs "
+              << "kConfig.revisit_if_any_include_changes.\n";
     return EXIT_FAILURE;
   }
 
-  auto compdb_ts = fs::last_write_time("compile_commands.json", ec);
-  if (ec.value() != 0) {
-    compdb_ts = fs::last_write_time("compile_flags.txt", ec);
+  // Test that key files exist and remember their last change.
+  if (!fs::exists(GetClangTidyConfig())) {
+    std::cerr << "Need a " << GetClangTidyConfig() << " config file.\n";
+    return EXIT_FAILURE;
   }
+
+  std::error_code ec;
+  const auto toplevel_build_ts =
+      fs::last_write_time(kConfig.toplevel_build_file, ec);
   if (ec.value() != 0) {
+    std::cerr << "Script needs to be executed in toplevel project dir.\n";
+    return EXIT_FAILURE;
+  }
+
+  // Changes in the compilation DB are tracked per file with the fingerprint
+  // of its compile command.
+  CompilationDatabase compilation_db;
+  if (!compilation_db.Load()) {
     std::cerr << "No compilation db compile_commands.json or compile_flags.txt "
               << "found; create that first. For cmake projects, often simply\n"
               << "\tln -s build/compile_commands.json .\n";
     return EXIT_FAILURE;
   }
-
-  const auto build_env_latest_change = std::max(toplevel_build_ts, compdb_ts);
+  tracer.EndPhase("load compilation db");
 
   std::string cache_prefix{kConfig.cache_prefix};
   if (cache_prefix.empty()) {
     // Cache prefix not set, choose name of directory
     cache_prefix = fs::current_path().filename().string() + "_";
   }
-  ClangTidyRunner runner(cache_prefix, argc, argv);
-  ContentAddressedStore store(runner.project_cache_dir());
+  ClangTidyRunner runner(cache_prefix, clang_tidy_args, compilation_db);
+  runner.set_export_fixes(fix);
+  ProjectCacheLock cache_lock(runner.project_cache_dir());
+  auto open_store = [](const fs::path &dir)
+      -> std::unique_ptr<ContentAddressedStore> {
+    if (EnvWithFallback("CACHE_STORE", kConfig.cache_store) == "packed") {
+      const bool compress =
+          atoi(EnvWithFallback("CACHE_COMPRESS",
+                               kConfig.compress_cache ? "1" : "0")
+                   .data()) != 0;
+      return std::make_unique<PackedContentStore>(dir, compress);
+    }
+    return std::make_unique<FileContentStore>(dir);
+  };
+  const std::unique_ptr<ContentAddressedStore> store =
+      open_store(runner.project_cache_dir());
   std::cerr << "Cache dir " << runner.project_cache_dir() << "\n";
 
-  FileGatherer cc_file_gatherer(store, kConfig.start_dir);
-  auto work_list = cc_file_gatherer.BuildWorkList(build_env_latest_change);
+  // A run that only narrows down the checks with --checks=<globs> can be
+  // served from the cache of runs without it. (Not with hierarchical
+  // configurations: the checks enabled differ per directory).
+  std::optional<CheckSubsetFilter> check_subset;
+  std::unique_ptr<ClangTidyRunner> full_runner;
+  std::unique_ptr<ProjectCacheLock> full_cache_lock;
+  std::unique_ptr<ContentAddressedStore> full_store;
+  if (!gc_only && !UseHierarchicalConfigs() && clang_tidy_args.size() == 1 &&
+      clang_tidy_args[0].rfind("--checks=", 0) == 0) {
+    full_runner = std::make_unique<ClangTidyRunner>(
+        cache_prefix, std::vector<std::string>{}, compilation_db);
+    if (fs::exists(full_runner->project_cache_dir(), ec)) {
+      check_subset = CheckSubsetFilter::Create(
+          std::string_view(clang_tidy_args[0]).substr(9),
+          runner.EnabledChecks(), full_runner->EnabledChecks());
+    }
+    if (check_subset) {
+      full_cache_lock =
+          std::make_unique<ProjectCacheLock>(full_runner->project_cache_dir());
+      full_store = open_store(full_runner->project_cache_dir());
+    }
+  }
+
+  // If this is a new configuration only differing from a previous one in
+  // the checks enabled, its results can be reused: only checks added need
+  // to run, findings of checks removed are dropped.
+  std::optional<CacheDirChecks> checks_of_cache;
+  std::optional<fs::path> other_checks_dir;
+  std::vector<std::string> added_checks;
+  std::vector<std::string> removed_checks;
+  if (!gc_only && !UseHierarchicalConfigs() && clang_tidy_args.empty() &&
+      !CacheDirChecks::Load(runner.project_cache_dir())) {
+    checks_of_cache.emplace(runner.ConfigurationWithoutChecks(),
+                            runner.EnabledChecks());
+    other_checks_dir = checks_of_cache->FindSiblingWithOtherChecks(
+        runner.project_cache_dir(), &added_checks, &removed_checks);
+    checks_of_cache->Save(runner.project_cache_dir());
+  }
+  tracer.EndPhase("setup");
+
+  const CacheGarbageCollector garbage_collector;
+  // Access times are only needed for least-recently-used eviction; don't
+  // spend time writing them otherwise.
+  auto flush_access_times = [&](ContentAddressedStore &s) {
+    if (garbage_collector.has_budget()) {
+      s.FlushAccessTimes();
+    }
+  };
+  if (gc_only) {
+    if (!garbage_collector.has_budget()) {
+      std::cerr << "Set CACHE_MAX_SIZE and/or CACHE_MAX_AGE_DAYS to collect "
+                << "garbage.\n";
+      return EXIT_FAILURE;
+    }
+    garbage_collector.Run(runner.project_cache_dir(), &cache_lock, store.get());
+    return EXIT_SUCCESS;
+  }
+
+  // Make it possible to keep independent state for different invocation
+  // locations (e.g. two checkouts of the same project) using the same cache.
+  const std::string checkout_suffix =
+      ToHex(hashContent(fs::current_path().string()));
+  ContentHasher hasher(runner.project_cache_dir() /
+                       ("stat-index-" + checkout_suffix));
+  FileHistory history(runner.project_cache_dir() /
+                      ("history-" + checkout_suffix));
+  const DependencyTracker dependencies(*store, hasher);
+  for (const std::string &merge_file : merge_files) {
+    const auto imported =
+        FileGatherer::ImportResults(merge_file, *store, dependencies, &history);
+    if (!imported) {
+      std::cerr << "Could not read " << merge_file << "\n";
+      return EXIT_FAILURE;
+    }
+    std::cerr << "Merged " << *imported << " results from " << merge_file
+              << "\n";
+  }
+  if (!merge_files.empty()) {
+    tracer.EndPhase("merge");
+  }
+  FileGatherer cc_file_gatherer(*store, hasher, dependencies, compilation_db,
+                                kConfig.start_dir);
+  if (since_rev) {
+    const auto changed_files = GitChangedFilesSince(*since_rev);
+    if (!changed_files) {
+      std::cerr << "Could not determine files changed since " << *since_rev
+                << "\n";
+      return EXIT_FAILURE;
+    }
+    cc_file_gatherer.UseFiles(*changed_files, include_dependents);
+  } else {
+    cc_file_gatherer.FindFiles();
+  }
+  if (shard_count > 0) {
+    cc_file_gatherer.KeepShard(shard_index, shard_count, shard_weights);
+  }
+  tracer.EndPhase("find files");
+  auto work_list = cc_file_gatherer.BuildWorkList(toplevel_build_ts);
+  tracer.EndPhase("build work list");
+  if (!merge_files.empty()) {
+    if (!work_list.empty()) {
+      std::cerr << work_list.size() << " files had no result in the merged "
+                << "exports and are processed here:\n";
+      size_t listed = 0;
+      for (const filepath_contenthash_t &work : work_list) {
+        if (++listed > 20) {
+          std::cerr << "  ...\n";
+          break;
+        }
+        std::cerr << "  " << work.first.string() << "\n";
+      }
+    }
+    const std::string weights_file = cache_prefix + "clang-tidy.shard-weights";
+    if (cc_file_gatherer.WriteShardWeights(weights_file, history)) {
+      std::cerr << "Weights for --shard-weights: " << weights_file << "\n";
+    }
+  }
+  if (check_subset && !work_list.empty()) {
+    const DependencyTracker full_dependencies(*full_store, hasher);
+    const size_t served = ServeFromRunWithMoreChecks(
+        *full_store, full_dependencies, *check_subset, *store, dependencies,
+        toplevel_build_ts, &work_list);
+    std::cerr << served << " files served from results with all checks in "
+              << full_runner->project_cache_dir() << "\n";
+    flush_access_times(*full_store);
+    tracer.EndPhase("serve from results with all checks");
+  }
+  if (other_checks_dir && !work_list.empty()) {
+    const ProjectCacheLock other_cache_lock(*other_checks_dir);
+    const auto other_store = open_store(*other_checks_dir);
+    const DependencyTracker other_dependencies(*other_store, hasher);
+    const auto without_removed =
+        CheckSubsetFilter::ForChecks(checks_of_cache->checks(), true);
+    std::cerr << "Configuration differs from " << *other_checks_dir << " in "
+              << added_checks.size() << " checks added and "
+              << removed_checks.size() << " removed.\n";
+    // Changing the checks is accounted for; no need to revisit because of
+    // that if the configuration is what is watched for changes.
+    const file_time min_freshness =
+        kConfig.toplevel_build_file == GetClangTidyConfig()
+            ? file_time::min()
+            : toplevel_build_ts;
+    if (added_checks.empty()) {
+      const size_t served = ServeFromRunWithMoreChecks(
+          *other_store, other_dependencies, without_removed, *store,
+          dependencies, min_freshness, &work_list);
+      std::cerr << served << " files served from there.\n";
+    } else {
+      // Run only the added checks and merge with what we have.
+      std::list<filepath_contenthash_t> delta_list;
+      const auto previous_results =
+          FilteredResultsOf(*other_store, other_dependencies, without_removed,
+                            min_freshness, &work_list, &delta_list);
+      std::string checks = "--checks=-*";
+      for (const std::string &check : added_checks) {
+        checks.append(",").append(check);
+      }
+      const auto only_added = CheckSubsetFilter::ForChecks(added_checks, false);
+      std::cerr << "Running only added checks on " << delta_list.size()
+                << " files.\n";
+      runner.WithExtraArgs({checks}).RunClangTidyOn(
+          *store, dependencies, &history, &delta_list, /*keep_order=*/false,
+          [&](const fs::path &file, std::string output) {
+            return MergeFindings(previous_results.at(file.string()),
+                                 only_added.Apply(output));
+          });
+    }
+    flush_access_times(*other_store);
+    tracer.EndPhase("reuse results with other checks");
+  }
+
+  if (fix) {
+    // Results from runs that did not export fixes need another run.
+    cc_file_gatherer.AddFilesWithoutFixes(&work_list);
+  }
+  if (kConfig.files_from_compilation_db) {
+    cc_file_gatherer.DivertHeaders(&work_list);
+  }
+
+  // Shards have their own report of the files in the shard, and export
+  // the results to be merged with --merge=<export-file>.
+  std::string report_variant = since_rev ? "-since" : "";
+  std::string report_prefix = cache_prefix;
+  if (shard_count > 0) {
+    const std::string shard = "shard-" + std::to_string(shard_index) + "-of-" +
+                              std::to_string(shard_count);
+    report_variant.append("-").append(shard);
+    report_prefix.append(shard).append("_");
+  }
+  const std::string detailed_report = report_prefix + "clang-tidy.out";
+  const std::string summary = report_prefix + "clang-tidy.summary";
+
+#ifdef __linux__
+  // Watch from the start, so that files saved during the first run are
+  // picked up right after.
+  std::optional<TreeWatcher> watcher;
+  if (watch) {
+    watcher.emplace(
+        kConfig.start_dir,
+        [&](const fs::path &dir) {
+          return cc_file_gatherer.IsExcludedDir(dir);
+        },
+        [](const fs::path &file) {
+          return ConsiderExtension(file.extension().string()) ||
+                 (UseHierarchicalConfigs() && file.filename() == ".clang-tidy");
+        });
+    if (!watcher->ok()) {
+      std::cerr << "Can't watch for changes: " << strerror(errno) << "\n";
+      return EXIT_FAILURE;
+    }
+  }
+#else
+  if (watch) {
+    std::cerr << "--watch is only supported on Linux.\n";
+    return EXIT_FAILURE;
+  }
+#endif
+
+  // While processing, findings show up in the detailed report as soon as
+  // they are known, so there is something to work on in a long run.
+  auto run_with_live_report = [&](bool keep_order) {
+    const std::unique_ptr<LiveReport> live_report =
+        cc_file_gatherer.StartLiveReport(runner.project_cache_dir(),
+                                         report_variant, detailed_report,
+                                         work_list);
+    if (live_report && !keep_order) {
+      std::cerr << "Findings are added to " << detailed_report
+                << " as files are processed.\n";
+    }
+    if (live_report) {
+      runner.set_result_listener(
+          [&](const fs::path &file, std::string_view result) {
+            live_report->Append(file, result);
+          });
+    }
+    runner.RunClangTidyOn(*store, dependencies, &history, &work_list,
+                          keep_order);
+    runner.set_result_listener({});
+    cc_file_gatherer.ServeDivertedHeaders();
+    tracer.EndPhase("clang-tidy");
+    // Also if nothing was processed, files might have been deleted.
+    const size_t count = cc_file_gatherer.CreateReport(
+        runner.project_cache_dir(), report_variant, detailed_report, summary);
+    tracer.EndPhase("report");
+    return count;
+  };
 
   // Now the expensive part...
-  runner.RunClangTidyOn(store, &work_list);
+  const size_t tidy_count = run_with_live_report(/*keep_order=*/false);
+  history.Save();
+  if (shard_count > 0) {
+    const std::string export_file = report_prefix + "clang-tidy.export";
+    if (!cc_file_gatherer.ExportResults(export_file, history)) {
+      std::cerr << "Could not write " << export_file << "\n";
+      return EXIT_FAILURE;
+    }
+    std::cerr << "Results to merge: " << export_file << "\n";
+    tracer.EndPhase("export");
+  }
+  if (fix) {
+    FixApplier fixes;
+    cc_file_gatherer.CollectFixes(fix_notes, fix_errors, &fixes);
+    const FixApplier::Stats stats = fixes.Apply(runner.FormatStyle());
+    std::cerr << "Applied " << stats.fixes << " fixes to " << stats.files
+              << " files.\n";
+    if (stats.conflicts > 0) {
+      std::cerr << stats.conflicts << " fixes conflicting with others were "
+                << "not applied; run again to apply them.\n";
+    }
+    if (stats.stale_files > 0) {
+      std::cerr << stats.stale_files << " files changed since their fixes "
+                << "were exported; run again to fix them.\n";
+    }
+    if (stats.unformatted_files > 0) {
+      std::cerr << "Could not format the fixes in " << stats.unformatted_files
+                << " files; is clang-format in PATH ?\n";
+    }
+    tracer.EndPhase("apply fixes");
+  }
+  hasher.SaveIndex(/*keep_unseen=*/since_rev.has_value());
+  flush_access_times(*store);
+  tracer.EndPhase("save state");
+  if (garbage_collector.IsDue(runner.project_cache_dir())) {
+    garbage_collector.Run(runner.project_cache_dir(), &cache_lock, store.get());
+    tracer.EndPhase("garbage collection");
+  }
+  tracer.Write();
 
-  const std::string detailed_report = cache_prefix + "clang-tidy.out";
-  const std::string summary = cache_prefix + "clang-tidy.summary";
-  const size_t tidy_count = cc_file_gatherer.CreateReport(
-      runner.project_cache_dir(), detailed_report, summary);
+#ifdef __linux__
+  if (watcher) {
+    std::cerr << "Watching for changes. Ctrl-C to exit.\n";
+    for (;;) {
+      const std::optional<std::vector<fs::path>> changed =
+          watcher->WaitForChanges();
+      tracer.EndPhase("wait for changes");
+      if (changed) {
+        work_list =
+            cc_file_gatherer.UpdateWorkList(*changed, toplevel_build_ts);
+      } else {
+        std::cerr << "Too many changes at once; looking at all files.\n";
+        work_list = cc_file_gatherer.RebuildWorkList(toplevel_build_ts);
+      }
+      tracer.EndPhase("update work list");
+      if (kConfig.files_from_compilation_db) {
+        cc_file_gatherer.DivertHeaders(&work_list);
+      }
+      // Most recently saved first; that is what the user is looking at.
+      run_with_live_report(/*keep_order=*/true);
+      fflush(stdout);
+      history.Save();
+      hasher.SaveIndex(/*keep_unseen=*/since_rev.has_value());
+      flush_access_times(*store);
+      tracer.EndPhase("save state");
+      if (garbage_collector.IsDue(runner.project_cache_dir())) {
+        garbage_collector.Run(runner.project_cache_dir(), &cache_lock,
+                              store.get());
+        tracer.EndPhase("garbage collection");
+      }
+      tracer.Write();
+    }
+  }
+#endif
 
   return tidy_count == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
 }
+#endif  // RUN_CLANG_TIDY_CACHED_NO_MAIN